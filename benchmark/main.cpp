@@ -0,0 +1,765 @@
+/*
+* Copyright (c) 2019 Erin Catto http://www.box2d.org
+*
+* Permission to use, copy, modify, distribute and sell this software
+* and its documentation for any purpose is hereby granted without fee,
+* provided that the above copyright notice appear in all copies.
+* Erin Catto makes no representations about the suitability
+* of this software for any purpose.
+* It is provided "as is" without express or implied warranty.
+*/
+
+// Headless benchmark for the dynamic tree. This runs the build, reinsert, optimize,
+// and query phases for every insertion heuristic and every builder on the data sets
+// used by the samples and prints the results as CSV or JSON.
+
+#define _CRT_SECURE_NO_WARNINGS
+#include "dynamic-tree/batch_query.h"
+#include "dynamic-tree/compact_tree.h"
+#include "dynamic-tree/task_scheduler.h"
+#include "dynamic-tree/wide_tree.h"
+#include "dynamic-tree/tree.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#ifndef DT_BENCH_DATA_DIR
+#define DT_BENCH_DATA_DIR "data"
+#endif
+
+enum Builder
+{
+	e_incremental,
+	e_topDownSAH,
+	e_topDownSAHParallel,
+	e_topDownMedian,
+	e_linear,
+	e_bottomUp,
+	e_ploc
+};
+
+struct Method
+{
+	const char* name;
+	Builder builder;
+	dtInsertionHeuristic heuristic;
+};
+
+static const Method s_methods[] =
+{
+	{ "sah", e_incremental, dt_sah },
+	{ "sah_rotate", e_incremental, dt_sah_rotate },
+	{ "bittner", e_incremental, dt_bittner },
+	{ "approx_sah", e_incremental, dt_approx_sah },
+	{ "approx_sah_rotate", e_incremental, dt_approx_sah_rotate },
+	{ "manhattan", e_incremental, dt_manhattan },
+	{ "top_down_sah", e_topDownSAH, dt_sah },
+	{ "top_down_sah_parallel", e_topDownSAHParallel, dt_sah },
+	{ "top_down_median", e_topDownMedian, dt_sah },
+	{ "lbvh", e_linear, dt_sah },
+	{ "bottom_up", e_bottomUp, dt_sah },
+	{ "ploc", e_ploc, dt_sah },
+};
+
+static const int s_methodCount = sizeof(s_methods) / sizeof(s_methods[0]);
+
+static const char* s_dataSets[] =
+{
+	"BlizzardLand",
+	"BlizzardLandEditor",
+	"Gibraltar",
+	"Himalayas",
+	"Mexico",
+	"BlizzardLandDynamic",
+	"BlizzardLandKinematic",
+	"BlizzardLandStatic",
+};
+
+static const int s_dataSetCount = sizeof(s_dataSets) / sizeof(s_dataSets[0]);
+
+struct Settings
+{
+	const char* dataPath = DT_BENCH_DATA_DIR;
+	const char* dataSet = nullptr;
+	const char* method = nullptr;
+	bool json = false;
+	int reinsertCount = 1000;
+	int optimizeIterations = 1000;
+	int treeletIterations = 0;
+	float reinsertionTime = 0.0f;
+	int queryCount = 10000;
+	int rayCount = 10000;
+
+	// Threads used by the parallel methods. Negative uses every hardware thread.
+	int threadCount = -1;
+
+	// RebuildBottomUp is cubic in the leaf count.
+	int bottomUpLimit = 2000;
+};
+
+struct QueryResult
+{
+	float queryTime;
+	int queryHitCount;
+	float rayCastTime;
+	int rayHitCount;
+};
+
+struct Result
+{
+	const char* dataSet;
+	const char* method;
+	int proxyCount;
+	bool skipped;
+	float buildTime;
+	int height;
+	float areaRatio;
+	float reinsertTime;
+	float optimizeTime;
+	float optimizedAreaRatio;
+	float treeletTime;
+	float treeletAreaRatio;
+	float reinsertionTime;
+	float reinsertionAreaRatio;
+	QueryResult binary;
+	float compactBuildTime;
+	QueryResult compact;
+	int wideWidth;
+	float wideBuildTime;
+	QueryResult wide;
+	QueryResult batch;
+};
+
+// Portable generator so every platform runs the same queries.
+struct Random
+{
+	unsigned int m_state = 12345;
+
+	float Next()
+	{
+		m_state = 1664525u * m_state + 1013904223u;
+		return float(m_state >> 8) / float(1 << 24);
+	}
+
+	int Next(int count)
+	{
+		return int(Next() * count) % count;
+	}
+};
+
+struct QueryCounter
+{
+	bool QueryCallback(int proxyId)
+	{
+		(void)proxyId;
+		++m_count;
+		return true;
+	}
+
+	int m_count = 0;
+};
+
+// Finds the closest proxy AABB hit by a ray.
+struct RayCastClosest
+{
+	float RayCastCallback(const dtVec& origin, const dtVec& direction, float maxFraction, int proxyId)
+	{
+		(void)direction;
+		float fraction = dtRayCastAABB(m_tree->GetAABB(proxyId), origin, m_invDirection, maxFraction);
+		if (fraction == FLT_MAX)
+		{
+			return -1.0f;
+		}
+
+		m_hit = true;
+		return fraction;
+	}
+
+	const dtTree* m_tree;
+	dtVec m_invDirection;
+	bool m_hit = false;
+};
+
+struct Ray
+{
+	dtVec origin;
+	dtVec direction;
+};
+
+static bool LoadBoxes(const char* path, std::vector<dtAABB>& boxes)
+{
+	FILE* file = fopen(path, "r");
+	if (file == nullptr)
+	{
+		return false;
+	}
+
+	const int k_bufferSize = 256;
+	char buffer[k_bufferSize];
+
+	// Each box is stored as a pair of vertices.
+	std::vector<float> coordinates;
+	while (fgets(buffer, k_bufferSize, file))
+	{
+		float x, y, z;
+		if (buffer[0] == 'v' && sscanf(buffer, "v %f %f %f", &x, &y, &z) == 3)
+		{
+			coordinates.push_back(x);
+			coordinates.push_back(y);
+			coordinates.push_back(z);
+		}
+	}
+
+	fclose(file);
+
+	int count = int(coordinates.size()) / 6;
+	boxes.resize(count);
+	for (int i = 0; i < count; ++i)
+	{
+		const float* v = coordinates.data() + 6 * i;
+		boxes[i].lowerBound = dtVecSet(v[0], v[1], v[2]);
+		boxes[i].upperBound = dtVecSet(v[3], v[4], v[5]);
+	}
+
+	return count > 0;
+}
+
+// Box queries are centered on objects and sized relative to the world. Rays go from
+// a random point in the world to an object, like a line of sight test.
+static void CreateQueries(const Settings& settings, const std::vector<dtAABB>& boxes, std::vector<dtAABB>& queries, std::vector<Ray>& rays)
+{
+	int count = int(boxes.size());
+
+	dtAABB world = boxes[0];
+	for (int i = 1; i < count; ++i)
+	{
+		world = dtUnion(world, boxes[i]);
+	}
+
+	dtVec extent = dtSplat(0.01f) * dtExtent(world);
+
+	Random random;
+
+	queries.resize(settings.queryCount);
+	for (int i = 0; i < settings.queryCount; ++i)
+	{
+		dtVec center = dtCenter(boxes[random.Next(count)]);
+		queries[i].lowerBound = center - extent;
+		queries[i].upperBound = center + extent;
+	}
+
+	rays.resize(settings.rayCount);
+	for (int i = 0; i < settings.rayCount; ++i)
+	{
+		float x = random.Next(), y = random.Next(), z = random.Next();
+		dtVec p1 = world.lowerBound + dtVecSet(x, y, z) * (world.upperBound - world.lowerBound);
+		dtVec p2 = dtCenter(boxes[random.Next(count)]);
+		rays[i].origin = p1;
+		rays[i].direction = p2 - p1;
+	}
+}
+
+// Runs the AABB queries and ray casts against any tree with the dtTree query interface.
+template <typename T>
+static void RunQueries(const T& queryTree, const dtTree& tree, const std::vector<dtAABB>& queries,
+	const std::vector<Ray>& rays, QueryResult& result)
+{
+	QueryCounter counter;
+	dtTimer timer;
+	for (int i = 0; i < int(queries.size()); ++i)
+	{
+		queryTree.Query(queries[i], &counter);
+	}
+	result.queryTime = timer.GetMilliseconds();
+	result.queryHitCount = counter.m_count;
+
+	int hitCount = 0;
+	timer.Reset();
+	for (int i = 0; i < int(rays.size()); ++i)
+	{
+		RayCastClosest callback;
+		callback.m_tree = &tree;
+		callback.m_invDirection = dtRayInverse(rays[i].direction);
+		queryTree.RayCast(rays[i].origin, rays[i].direction, 1.0f, &callback);
+		hitCount += callback.m_hit ? 1 : 0;
+	}
+	result.rayCastTime = timer.GetMilliseconds();
+	result.rayHitCount = hitCount;
+}
+
+// Runs the same queries as RunQueries through dtBatchQuery on all threads. An untimed
+// batch of each kind goes first so the timings do not include growing the hit chunks
+// and waking the workers.
+static void RunBatchQueries(const dtTree& tree, dtTaskScheduler& scheduler, const std::vector<dtAABB>& queries,
+	const std::vector<Ray>& rays, QueryResult& result)
+{
+	dtBatchQuery batch;
+
+	batch.Query(tree, queries.data(), int(queries.size()), scheduler);
+
+	dtTimer timer;
+	batch.Query(tree, queries.data(), int(queries.size()), scheduler);
+	result.queryTime = timer.GetMilliseconds();
+	result.queryHitCount = batch.GetTotalHitCount();
+
+	// Allocated like the node pool. A std::vector<dtVec> would drop the alignment attribute.
+	int rayCount = int(rays.size());
+	dtVec* origins = (dtVec*)malloc(2 * rayCount * sizeof(dtVec));
+	dtVec* directions = origins + rayCount;
+	for (int i = 0; i < rayCount; ++i)
+	{
+		origins[i] = rays[i].origin;
+		directions[i] = rays[i].direction;
+	}
+
+	batch.RayCast(tree, origins, directions, rayCount, 1.0f, scheduler);
+
+	timer.Reset();
+	batch.RayCast(tree, origins, directions, rayCount, 1.0f, scheduler);
+	result.rayCastTime = timer.GetMilliseconds();
+
+	free(origins);
+
+	int hitCount = 0;
+	for (int i = 0; i < rayCount; ++i)
+	{
+		hitCount += batch.GetHitCount(i) > 0 ? 1 : 0;
+	}
+	result.rayHitCount = hitCount;
+}
+
+static void RunMethod(const Settings& settings, const Method& method, dtTaskScheduler& scheduler,
+	const std::vector<dtAABB>& boxes, const std::vector<dtAABB>& queries, const std::vector<Ray>& rays, Result& result)
+{
+	int count = int(boxes.size());
+	result.proxyCount = count;
+
+	if (method.builder == e_bottomUp && count > settings.bottomUpLimit)
+	{
+		result.skipped = true;
+		return;
+	}
+
+	// The builders take the boxes as non-const
+	std::vector<dtAABB> buildBoxes(boxes);
+	std::vector<int> proxies(count);
+
+	dtTree tree;
+	tree.m_heuristic = method.heuristic;
+
+	// Keep the boxes tight so the incremental trees compare with the builders.
+	tree.m_aabbMargin = 0.0f;
+
+	dtTimer timer;
+	switch (method.builder)
+	{
+	case e_incremental:
+		for (int i = 0; i < count; ++i)
+		{
+			proxies[i] = tree.CreateProxy(buildBoxes[i], i);
+		}
+		result.buildTime = timer.GetMilliseconds();
+		break;
+
+	case e_topDownSAH:
+		tree.BuildTopDownSAH(proxies.data(), buildBoxes.data(), count);
+		result.buildTime = timer.GetMilliseconds();
+		break;
+
+	case e_topDownSAHParallel:
+		tree.BuildTopDownSAHParallel(proxies.data(), buildBoxes.data(), count, scheduler);
+		result.buildTime = timer.GetMilliseconds();
+		break;
+
+	case e_topDownMedian:
+		tree.BuildTopDownMedianSplit(proxies.data(), buildBoxes.data(), count);
+		result.buildTime = timer.GetMilliseconds();
+		break;
+
+	case e_linear:
+		tree.BuildLBVH(proxies.data(), buildBoxes.data(), count);
+		result.buildTime = timer.GetMilliseconds();
+		break;
+
+	case e_bottomUp:
+		for (int i = 0; i < count; ++i)
+		{
+			proxies[i] = tree.CreateProxy(buildBoxes[i], i);
+		}
+
+		// Only the rebuild is timed.
+		timer.Reset();
+		tree.RebuildBottomUp();
+		result.buildTime = timer.GetMilliseconds();
+		break;
+
+	case e_ploc:
+		for (int i = 0; i < count; ++i)
+		{
+			proxies[i] = tree.CreateProxy(buildBoxes[i], i);
+		}
+
+		// Only the rebuild is timed.
+		timer.Reset();
+		tree.RebuildPLOC(16, &scheduler);
+		result.buildTime = timer.GetMilliseconds();
+		break;
+	}
+
+	result.height = tree.GetHeight();
+	result.areaRatio = tree.GetAreaRatio();
+
+	// Reinsert proxies round robin, like the samples do.
+	timer.Reset();
+	int base = 0;
+	for (int i = 0; i < settings.reinsertCount; ++i)
+	{
+		tree.DestroyProxy(proxies[base]);
+		proxies[base] = tree.CreateProxy(boxes[base], base);
+
+		base += 1;
+		if (base == count)
+		{
+			base = 0;
+		}
+	}
+	result.reinsertTime = timer.GetMilliseconds();
+
+	timer.Reset();
+	tree.Optimize(settings.optimizeIterations);
+	result.optimizeTime = timer.GetMilliseconds();
+	result.optimizedAreaRatio = tree.GetAreaRatio();
+
+	timer.Reset();
+	tree.OptimizeTreelets(settings.treeletIterations);
+	result.treeletTime = timer.GetMilliseconds();
+	result.treeletAreaRatio = tree.GetAreaRatio();
+
+	timer.Reset();
+	if (settings.reinsertionTime > 0.0f)
+	{
+		tree.OptimizeReinsertion(settings.reinsertionTime);
+	}
+	result.reinsertionTime = timer.GetMilliseconds();
+	result.reinsertionAreaRatio = tree.GetAreaRatio();
+
+	RunQueries(tree, tree, queries, rays, result.binary);
+
+	dtCompactTree compactTree;
+	timer.Reset();
+	compactTree.Build(tree);
+	result.compactBuildTime = timer.GetMilliseconds();
+
+	RunQueries(compactTree, tree, queries, rays, result.compact);
+
+	dtWideTree wideTree;
+	timer.Reset();
+	wideTree.Build(tree);
+	result.wideBuildTime = timer.GetMilliseconds();
+	result.wideWidth = wideTree.m_width;
+
+	RunQueries(wideTree, tree, queries, rays, result.wide);
+
+	RunBatchQueries(tree, scheduler, queries, rays, result.batch);
+}
+
+// Writes one result as a CSV row or a JSON object. In header mode the CSV
+// column names are written instead of the values.
+struct Writer
+{
+	void Begin()
+	{
+		m_fieldCount = 0;
+		if (m_json)
+		{
+			printf("%s  {", m_rowCount > 0 ? ",\n" : "");
+		}
+	}
+
+	void Name(const char* name)
+	{
+		const char* separator = m_fieldCount > 0 ? (m_json ? ", " : ",") : "";
+		++m_fieldCount;
+
+		if (m_json)
+		{
+			printf("%s\"%s\": ", separator, name);
+		}
+		else if (m_header)
+		{
+			printf("%s%s", separator, name);
+		}
+		else
+		{
+			printf("%s", separator);
+		}
+	}
+
+	void Field(const char* name, const char* value)
+	{
+		Name(name);
+		if (m_header == false)
+		{
+			printf(m_json ? "\"%s\"" : "%s", value);
+		}
+	}
+
+	void Field(const char* name, int value)
+	{
+		Name(name);
+		if (m_header == false)
+		{
+			printf("%d", value);
+		}
+	}
+
+	void Field(const char* name, float value)
+	{
+		Name(name);
+		if (m_header == false)
+		{
+			printf("%.4f", value);
+		}
+	}
+
+	void Field(const char* name, bool value)
+	{
+		Name(name);
+		if (m_header == false)
+		{
+			printf("%s", m_json ? (value ? "true" : "false") : (value ? "1" : "0"));
+		}
+	}
+
+	void End()
+	{
+		printf(m_json ? "}" : "\n");
+		++m_rowCount;
+	}
+
+	bool m_json = false;
+	bool m_header = false;
+	int m_fieldCount = 0;
+	int m_rowCount = 0;
+};
+
+static void WriteResult(Writer& w, const Result& r)
+{
+	w.Begin();
+	w.Field("data_set", r.dataSet);
+	w.Field("method", r.method);
+	w.Field("proxies", r.proxyCount);
+	w.Field("skipped", r.skipped);
+	w.Field("build_ms", r.buildTime);
+	w.Field("height", r.height);
+	w.Field("area_ratio", r.areaRatio);
+	w.Field("reinsert_ms", r.reinsertTime);
+	w.Field("optimize_ms", r.optimizeTime);
+	w.Field("optimized_area_ratio", r.optimizedAreaRatio);
+	w.Field("treelet_ms", r.treeletTime);
+	w.Field("treelet_area_ratio", r.treeletAreaRatio);
+	w.Field("reinsertion_ms", r.reinsertionTime);
+	w.Field("reinsertion_area_ratio", r.reinsertionAreaRatio);
+	w.Field("query_ms", r.binary.queryTime);
+	w.Field("query_hits", r.binary.queryHitCount);
+	w.Field("ray_cast_ms", r.binary.rayCastTime);
+	w.Field("ray_hits", r.binary.rayHitCount);
+	w.Field("compact_build_ms", r.compactBuildTime);
+	w.Field("compact_query_ms", r.compact.queryTime);
+	w.Field("compact_query_hits", r.compact.queryHitCount);
+	w.Field("compact_ray_cast_ms", r.compact.rayCastTime);
+	w.Field("compact_ray_hits", r.compact.rayHitCount);
+	w.Field("wide_width", r.wideWidth);
+	w.Field("wide_build_ms", r.wideBuildTime);
+	w.Field("wide_query_ms", r.wide.queryTime);
+	w.Field("wide_query_hits", r.wide.queryHitCount);
+	w.Field("wide_ray_cast_ms", r.wide.rayCastTime);
+	w.Field("wide_ray_hits", r.wide.rayHitCount);
+	w.Field("batch_query_ms", r.batch.queryTime);
+	w.Field("batch_query_hits", r.batch.queryHitCount);
+	w.Field("batch_ray_cast_ms", r.batch.rayCastTime);
+	w.Field("batch_ray_hits", r.batch.rayHitCount);
+	w.End();
+}
+
+static void PrintUsage()
+{
+	fprintf(stderr,
+		"usage: dynamic-tree-bench [options]\n"
+		"  --data <dir>            directory holding the data sets (default %s)\n"
+		"  --set <name>            only run one data set, such as BlizzardLand\n"
+		"  --method <name>         only run one method, such as top_down_sah\n"
+		"  --format <csv|json>     output format (default csv)\n"
+		"  --reinsert <count>      proxies reinserted after the build (default 1000)\n"
+		"  --optimize <count>      Optimize iterations after reinsertion (default 1000)\n"
+		"  --treelets <count>      treelets restructured after Optimize (default 0)\n"
+		"  --reinsertion <ms>      time for OptimizeReinsertion after the treelets (default 0)\n"
+		"  --queries <count>       AABB queries (default 10000)\n"
+		"  --rays <count>          ray casts (default 10000)\n"
+		"  --bottom-up-limit <n>   skip RebuildBottomUp above this many proxies (default 2000)\n"
+		"  --threads <count>       threads for the parallel methods (default all)\n",
+		DT_BENCH_DATA_DIR);
+}
+
+static bool ParseArguments(int argc, char** argv, Settings& settings)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		const char* arg = argv[i];
+		const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+		if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0 || value == nullptr)
+		{
+			return false;
+		}
+
+		if (strcmp(arg, "--data") == 0)
+		{
+			settings.dataPath = value;
+		}
+		else if (strcmp(arg, "--set") == 0)
+		{
+			settings.dataSet = value;
+		}
+		else if (strcmp(arg, "--method") == 0)
+		{
+			settings.method = value;
+		}
+		else if (strcmp(arg, "--format") == 0)
+		{
+			if (strcmp(value, "json") == 0)
+			{
+				settings.json = true;
+			}
+			else if (strcmp(value, "csv") == 0)
+			{
+				settings.json = false;
+			}
+			else
+			{
+				return false;
+			}
+		}
+		else if (strcmp(arg, "--reinsert") == 0)
+		{
+			settings.reinsertCount = dtMax(0, atoi(value));
+		}
+		else if (strcmp(arg, "--optimize") == 0)
+		{
+			settings.optimizeIterations = dtMax(0, atoi(value));
+		}
+		else if (strcmp(arg, "--treelets") == 0)
+		{
+			settings.treeletIterations = dtMax(0, atoi(value));
+		}
+		else if (strcmp(arg, "--reinsertion") == 0)
+		{
+			settings.reinsertionTime = dtMax(0.0f, float(atof(value)));
+		}
+		else if (strcmp(arg, "--queries") == 0)
+		{
+			settings.queryCount = dtMax(0, atoi(value));
+		}
+		else if (strcmp(arg, "--rays") == 0)
+		{
+			settings.rayCount = dtMax(0, atoi(value));
+		}
+		else if (strcmp(arg, "--bottom-up-limit") == 0)
+		{
+			settings.bottomUpLimit = dtMax(0, atoi(value));
+		}
+		else if (strcmp(arg, "--threads") == 0)
+		{
+			settings.threadCount = dtMax(1, atoi(value));
+		}
+		else
+		{
+			return false;
+		}
+
+		++i;
+	}
+
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	Settings settings;
+	if (ParseArguments(argc, argv, settings) == false)
+	{
+		PrintUsage();
+		return 1;
+	}
+
+	// The calling thread counts as one of the threads.
+	dtTaskScheduler scheduler(settings.threadCount - 1);
+
+	int dataSetCount = 0;
+
+	Writer writer;
+	writer.m_json = settings.json;
+
+	if (settings.json)
+	{
+		printf("[\n");
+	}
+	else
+	{
+		writer.m_header = true;
+		WriteResult(writer, Result());
+		writer.m_header = false;
+		writer.m_rowCount = 0;
+	}
+
+	for (int i = 0; i < s_dataSetCount; ++i)
+	{
+		const char* dataSet = s_dataSets[i];
+		if (settings.dataSet != nullptr && strcmp(settings.dataSet, dataSet) != 0)
+		{
+			continue;
+		}
+
+		char filePath[512];
+		snprintf(filePath, sizeof(filePath), "%s/%s.txt", settings.dataPath, dataSet);
+
+		std::vector<dtAABB> boxes;
+		if (LoadBoxes(filePath, boxes) == false)
+		{
+			fprintf(stderr, "failed to load %s\n", filePath);
+			continue;
+		}
+
+		++dataSetCount;
+
+		std::vector<dtAABB> queries;
+		std::vector<Ray> rays;
+		CreateQueries(settings, boxes, queries, rays);
+
+		for (int j = 0; j < s_methodCount; ++j)
+		{
+			const Method& method = s_methods[j];
+			if (settings.method != nullptr && strcmp(settings.method, method.name) != 0)
+			{
+				continue;
+			}
+
+			Result result = {};
+			result.dataSet = dataSet;
+			result.method = method.name;
+			RunMethod(settings, method, scheduler, boxes, queries, rays, result);
+
+			WriteResult(writer, result);
+			fflush(stdout);
+		}
+	}
+
+	if (settings.json)
+	{
+		printf("\n]\n");
+	}
+
+	return dataSetCount > 0 ? 0 : 1;
+}
@@ -0,0 +1,175 @@
+/*
+* Copyright (c) 2019 Erin Catto http://www.box2d.org
+*
+* Permission to use, copy, modify, distribute and sell this software
+* and its documentation for any purpose is hereby granted without fee,
+* provided that the above copyright notice appear in all copies.
+* Erin Catto makes no representations about the suitability
+* of this software for any purpose.
+* It is provided "as is" without express or implied warranty.
+*/
+
+#pragma once
+
+#include "dynamic-tree/task_scheduler.h"
+#include "dynamic-tree/utils.h"
+#include <vector>
+
+// Small enough that stealing balances uneven queries, large enough to amortize the tasks.
+#define dt_batchQueryRange 64
+
+// Proxy ids per hit chunk.
+#define dt_batchHitChunkSize 4096
+
+/// Runs arrays of box queries or ray casts on the threads of a scheduler. The tree
+/// must not change during a batch. Any tree with the dtTree query interface works,
+/// such as dtTree, dtCompactTree, dtWideTree or a published snapshot.
+/// Each thread appends the proxy ids it finds to its own list of fixed size chunks and
+/// the chunks are compacted into one array ordered by query when the batch is done.
+/// A full chunk is never moved, and the chunks are kept between batches, so repeated
+/// batches of similar size do not allocate.
+class dtBatchQuery
+{
+public:
+
+	dtBatchQuery();
+	~dtBatchQuery();
+
+	dtBatchQuery(const dtBatchQuery&) = delete;
+	dtBatchQuery& operator=(const dtBatchQuery&) = delete;
+
+	/// Find the proxies overlapping each box.
+	template <typename Tree>
+	void Query(const Tree& tree, const dtAABB* boxes, int count, dtTaskScheduler& scheduler);
+
+	/// Find the proxies whose AABB is hit by each ray segment origin + t * direction
+	/// with t in [0, maxFraction]. Hits are not sorted along the ray.
+	template <typename Tree>
+	void RayCast(const Tree& tree, const dtVec* origins, const dtVec* directions, int count,
+		float maxFraction, dtTaskScheduler& scheduler);
+
+	/// The number of queries in the last batch.
+	int GetQueryCount() const;
+
+	/// The number of proxies found by query i of the last batch.
+	int GetHitCount(int query) const;
+
+	/// The proxies found by query i of the last batch.
+	const int* GetHits(int query) const;
+
+	/// The number of proxies found by all queries of the last batch.
+	int GetTotalHitCount() const;
+
+private:
+
+	// Padded so threads appending to their buffers do not share a cache line.
+	struct alignas(64) ThreadBuffer
+	{
+		void Add(int proxyId)
+		{
+			int chunk = hitCount / dt_batchHitChunkSize;
+			if (chunk == int(chunks.size()))
+			{
+				chunks.push_back((int*)malloc(dt_batchHitChunkSize * sizeof(int)));
+			}
+
+			chunks[chunk][hitCount % dt_batchHitChunkSize] = proxyId;
+			++hitCount;
+		}
+
+		std::vector<int*> chunks;
+		int hitCount;
+	};
+
+	struct QueryCollector
+	{
+		bool QueryCallback(int proxyId)
+		{
+			buffer->Add(proxyId);
+			return true;
+		}
+
+		ThreadBuffer* buffer;
+	};
+
+	struct RayCollector
+	{
+		float RayCastCallback(const dtVec& origin, const dtVec& direction, float maxFraction, int proxyId)
+		{
+			(void)origin;
+			(void)direction;
+			(void)maxFraction;
+			buffer->Add(proxyId);
+
+			// Keep going without clipping the ray.
+			return -1.0f;
+		}
+
+		ThreadBuffer* buffer;
+	};
+
+	void Begin(int count, dtTaskScheduler& scheduler);
+	void Finish(dtTaskScheduler& scheduler);
+
+	std::vector<ThreadBuffer> m_threadBuffers;
+
+	// Where the hits of each query were written before compaction.
+	std::vector<int> m_threads;
+	std::vector<int> m_starts;
+
+	// Hits of query i are m_hits[m_offsets[i]] up to m_hits[m_offsets[i + 1]].
+	std::vector<int> m_offsets;
+	std::vector<int> m_hits;
+	int m_queryCount;
+};
+
+template <typename Tree>
+inline void dtBatchQuery::Query(const Tree& tree, const dtAABB* boxes, int count, dtTaskScheduler& scheduler)
+{
+	Begin(count, scheduler);
+
+	scheduler.ParallelFor(count, dt_batchQueryRange, [this, &tree, boxes, &scheduler](int begin, int end)
+	{
+		int threadIndex = scheduler.GetThreadIndex();
+		QueryCollector collector;
+		collector.buffer = &m_threadBuffers[threadIndex];
+
+		for (int i = begin; i < end; ++i)
+		{
+			int start = collector.buffer->hitCount;
+			tree.Query(boxes[i], &collector);
+
+			m_threads[i] = threadIndex;
+			m_starts[i] = start;
+			m_offsets[i + 1] = collector.buffer->hitCount - start;
+		}
+	});
+
+	Finish(scheduler);
+}
+
+template <typename Tree>
+inline void dtBatchQuery::RayCast(const Tree& tree, const dtVec* origins, const dtVec* directions, int count,
+	float maxFraction, dtTaskScheduler& scheduler)
+{
+	Begin(count, scheduler);
+
+	scheduler.ParallelFor(count, dt_batchQueryRange, [this, &tree, origins, directions, maxFraction, &scheduler](int begin, int end)
+	{
+		int threadIndex = scheduler.GetThreadIndex();
+		RayCollector collector;
+		collector.buffer = &m_threadBuffers[threadIndex];
+
+		for (int i = begin; i < end; ++i)
+		{
+			int start = collector.buffer->hitCount;
+			tree.RayCast(origins[i], directions[i], maxFraction, &collector);
+
+			m_threads[i] = threadIndex;
+			m_starts[i] = start;
+			m_offsets[i + 1] = collector.buffer->hitCount - start;
+		}
+	});
+
+	Finish(scheduler);
+}
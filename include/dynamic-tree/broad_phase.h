@@ -0,0 +1,164 @@
+/*
+* Copyright (c) 2019 Erin Catto http://www.box2d.org
+*
+* Permission to use, copy, modify, distribute and sell this software
+* and its documentation for any purpose is hereby granted without fee,
+* provided that the above copyright notice appear in all copies.
+* Erin Catto makes no representations about the suitability
+* of this software for any purpose.
+* It is provided "as is" without express or implied warranty.
+*/
+
+#pragma once
+
+#include "dynamic-tree/tree.h"
+#include <vector>
+
+/// A pair of proxies with overlapping AABBs. The smaller proxy id is always first.
+struct dtPair
+{
+	int proxyIdA;
+	int proxyIdB;
+};
+
+inline bool operator < (const dtPair& a, const dtPair& b)
+{
+	return a.proxyIdA < b.proxyIdA || (a.proxyIdA == b.proxyIdA && a.proxyIdB < b.proxyIdB);
+}
+
+inline bool operator == (const dtPair& a, const dtPair& b)
+{
+	return a.proxyIdA == b.proxyIdA && a.proxyIdB == b.proxyIdB;
+}
+
+/// The broad-phase keeps a persistent set of overlapping proxy pairs on top of a
+/// dynamic tree. Proxies that are created or moved are buffered and only those are
+/// queried against the tree when the pairs are updated. Pairs between proxies that
+/// did not move carry over from the previous update without any tree queries.
+struct dtBroadPhase
+{
+	dtBroadPhase();
+
+	/// Create a proxy and buffer it for pair finding.
+	int CreateProxy(const dtAABB& aabb, int objectIndex);
+
+	/// Destroy a proxy. Its pairs are ended on the next update.
+	void DestroyProxy(int proxyId);
+
+	/// Move a proxy to a new AABB. The proxy is only buffered for pair finding if it
+	/// left its fat AABB, otherwise its pairs are unchanged.
+	void MoveProxy(int proxyId, const dtAABB& aabb, const dtVec& displacement);
+
+	/// Get the fat AABB stored in the tree for a proxy.
+	const dtAABB& GetAABB(int proxyId) const;
+
+	/// Get the client object index of a proxy.
+	int GetObjectIndex(int proxyId) const;
+
+	int GetProxyCount() const;
+
+	/// Get the number of pairs found by the last update.
+	int GetPairCount() const;
+
+	/// Get the sorted pairs found by the last update.
+	const dtPair* GetPairs() const;
+
+	/// Update the pair set and report the differences with the previous update.
+	/// Events are reported in pair order and a pair is reported at most once, except
+	/// when a destroyed proxy id is reused in the same step, which ends the old pair
+	/// before beginning the new one. The callback must implement:
+	/// void BeginOverlap(int proxyIdA, int proxyIdB)
+	/// void PersistOverlap(int proxyIdA, int proxyIdB)
+	/// void EndOverlap(int proxyIdA, int proxyIdB)
+	template <typename T>
+	void UpdatePairs(T* callback);
+
+	/// Rebuild the pair set from the move buffer. The previous pairs are kept in m_oldPairs.
+	void FindPairs();
+
+	/// Called by the tree query for each proxy overlapping the moved proxy.
+	bool QueryCallback(int proxyId);
+
+	void BufferMove(int proxyId);
+	void UnBufferMove(int proxyId);
+
+	enum
+	{
+		e_moved = 0x1,
+		e_destroyed = 0x2
+	};
+
+	dtTree m_tree;
+
+	std::vector<int> m_moveBuffer;
+	std::vector<int> m_destroyBuffer;
+
+	// Per proxy flags used during the update. Indexed by proxy id.
+	std::vector<unsigned char> m_flags;
+
+	std::vector<dtPair> m_pairs;
+	std::vector<dtPair> m_oldPairs;
+
+	int m_queryProxyId;
+};
+
+template <typename T>
+inline void dtBroadPhase::UpdatePairs(T* callback)
+{
+	FindPairs();
+
+	// Both pair arrays are sorted, so a merge finds the differences.
+	const dtPair* oldPairs = m_oldPairs.data();
+	const dtPair* newPairs = m_pairs.data();
+	int oldCount = int(m_oldPairs.size());
+	int newCount = int(m_pairs.size());
+
+	int i = 0, j = 0;
+	while (i < oldCount || j < newCount)
+	{
+		if (j == newCount || (i < oldCount && oldPairs[i] < newPairs[j]))
+		{
+			callback->EndOverlap(oldPairs[i].proxyIdA, oldPairs[i].proxyIdB);
+			++i;
+		}
+		else if (i == oldCount || newPairs[j] < oldPairs[i])
+		{
+			callback->BeginOverlap(newPairs[j].proxyIdA, newPairs[j].proxyIdB);
+			++j;
+		}
+		else
+		{
+			const dtPair& pair = oldPairs[i];
+			if ((m_flags[pair.proxyIdA] | m_flags[pair.proxyIdB]) & e_destroyed)
+			{
+				// A destroyed proxy id was reused by a new proxy.
+				callback->EndOverlap(pair.proxyIdA, pair.proxyIdB);
+				callback->BeginOverlap(pair.proxyIdA, pair.proxyIdB);
+			}
+			else
+			{
+				callback->PersistOverlap(pair.proxyIdA, pair.proxyIdB);
+			}
+			++i;
+			++j;
+		}
+	}
+
+	// Reset the flags for the next update.
+	for (int k = 0; k < int(m_moveBuffer.size()); ++k)
+	{
+		if (m_moveBuffer[k] != dt_nullNode)
+		{
+			m_flags[m_moveBuffer[k]] = 0;
+		}
+	}
+
+	for (int k = 0; k < int(m_destroyBuffer.size()); ++k)
+	{
+		m_flags[m_destroyBuffer[k]] = 0;
+	}
+
+	m_moveBuffer.clear();
+	m_destroyBuffer.clear();
+	m_oldPairs.clear();
+}
@@ -0,0 +1,186 @@
+/*
+* Copyright (c) 2019 Erin Catto http://www.box2d.org
+*
+* Permission to use, copy, modify, distribute and sell this software
+* and its documentation for any purpose is hereby granted without fee,
+* provided that the above copyright notice appear in all copies.
+* Erin Catto makes no representations about the suitability
+* of this software for any purpose.
+* It is provided "as is" without express or implied warranty.
+*/
+
+#pragma once
+
+#include "dynamic-tree/tree.h"
+
+/// A 32 byte node holding only what traversal needs. The child index and proxy id
+/// sit in the w lanes of the bounds so a node is loaded with two aligned vector loads.
+struct dtCompactNode
+{
+	float lowerBound[3];
+
+	/// Second child of an internal node. The first child immediately follows the node.
+	/// This is dt_nullNode for leaves.
+	int child2;
+
+	float upperBound[3];
+
+	/// Proxy id in the source tree for leaves, dt_nullNode for internal nodes.
+	int proxyId;
+};
+
+/// Query side of a hot/cold split of dtTree. The dynamic tree keeps the parent links,
+/// heights and object indices needed for insertion while this holds a contiguous
+/// stream of bounds and child links in depth first order. A node takes half the
+/// memory of a dtNode and the first child is always on the same or next cache line.
+/// Rebuild it from the tree after updates, it is a linear copy.
+struct dtCompactTree
+{
+	dtCompactTree();
+	~dtCompactTree();
+
+	/// Copy the bounds and topology of a tree. This reuses the node storage.
+	void Build(const dtTree& tree);
+
+	void Clear();
+
+	int GetNodeCount() const;
+
+	/// Same as dtTree::Query. The callback receives proxy ids of the source tree.
+	template <typename T>
+	void Query(const dtAABB& aabb, T* callback) const;
+
+	/// Same as dtTree::RayCast. The callback receives proxy ids of the source tree.
+	template <typename T>
+	void RayCast(const dtVec& origin, const dtVec& direction, float maxFraction, T* callback) const;
+
+	dtCompactNode* m_nodes;
+	int m_nodeCount;
+	int m_nodeCapacity;
+};
+
+inline dtAABB dtGetCompactAABB(const dtCompactNode& node)
+{
+	// Clear the w lanes. The links read as denormal floats, which are very slow in
+	// the slab test arithmetic.
+	dtVec mask = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+
+	dtAABB aabb;
+	aabb.lowerBound = _mm_and_ps(_mm_load_ps(node.lowerBound), mask);
+	aabb.upperBound = _mm_and_ps(_mm_load_ps(node.upperBound), mask);
+	return aabb;
+}
+
+template <typename T>
+inline void dtCompactTree::Query(const dtAABB& aabb, T* callback) const
+{
+	if (m_nodeCount == 0)
+	{
+		return;
+	}
+
+	dtGrowableStack<int, 256> stack;
+	stack.Push(0);
+
+	while (stack.GetCount() > 0)
+	{
+		int nodeId = stack.Pop();
+		const dtCompactNode& node = m_nodes[nodeId];
+
+		if (dtTestOverlap(dtGetCompactAABB(node), aabb) == false)
+		{
+			continue;
+		}
+
+		if (node.child2 == dt_nullNode)
+		{
+			bool proceed = callback->QueryCallback(node.proxyId);
+			if (proceed == false)
+			{
+				return;
+			}
+		}
+		else
+		{
+			stack.Push(node.child2);
+			stack.Push(nodeId + 1);
+		}
+	}
+}
+
+template <typename T>
+inline void dtCompactTree::RayCast(const dtVec& origin, const dtVec& direction, float maxFraction, T* callback) const
+{
+	if (m_nodeCount == 0)
+	{
+		return;
+	}
+
+	dtVec invDirection = dtRayInverse(direction);
+
+	dtRayCastNode entry;
+	entry.index = 0;
+	entry.fraction = dtRayCastAABB(dtGetCompactAABB(m_nodes[0]), origin, invDirection, maxFraction);
+	if (entry.fraction == FLT_MAX)
+	{
+		return;
+	}
+
+	dtGrowableStack<dtRayCastNode, 256> stack;
+	stack.Push(entry);
+
+	while (stack.GetCount() > 0)
+	{
+		entry = stack.Pop();
+		if (entry.fraction > maxFraction)
+		{
+			// The ray was clipped after this node was pushed.
+			continue;
+		}
+
+		const dtCompactNode& node = m_nodes[entry.index];
+
+		if (node.child2 == dt_nullNode)
+		{
+			float value = callback->RayCastCallback(origin, direction, maxFraction, node.proxyId);
+
+			if (value == 0.0f)
+			{
+				// The client has terminated the ray cast.
+				return;
+			}
+
+			if (value > 0.0f)
+			{
+				// Clip the ray.
+				maxFraction = dtMin(value, maxFraction);
+			}
+
+			continue;
+		}
+
+		dtRayCastNode entry1;
+		entry1.index = entry.index + 1;
+		entry1.fraction = dtRayCastAABB(dtGetCompactAABB(m_nodes[entry1.index]), origin, invDirection, maxFraction);
+
+		dtRayCastNode entry2;
+		entry2.index = node.child2;
+		entry2.fraction = dtRayCastAABB(dtGetCompactAABB(m_nodes[entry2.index]), origin, invDirection, maxFraction);
+
+		// Push the far child first so the near child is popped first.
+		if (entry2.fraction < entry1.fraction)
+		{
+			dtSwap(entry1, entry2);
+		}
+
+		if (entry2.fraction != FLT_MAX)
+		{
+			stack.Push(entry2);
+		}
+
+		if (entry1.fraction != FLT_MAX)
+		{
+			stack.Push(entry1);
+		}
+	}
+}
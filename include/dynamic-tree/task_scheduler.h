@@ -0,0 +1,188 @@
+/*
+* Copyright (c) 2019 Erin Catto http://www.box2d.org
+*
+* Permission to use, copy, modify, distribute and sell this software
+* and its documentation for any purpose is hereby granted without fee,
+* provided that the above copyright notice appear in all copies.
+* Erin Catto makes no representations about the suitability
+* of this software for any purpose.
+* It is provided "as is" without express or implied warranty.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Tasks queued per thread. Must be a power of two. A thread with a full queue runs
+/// new tasks immediately.
+#define dt_maxQueuedTasks 256
+
+/// A task is a function and a context pointer that must stay valid until the task
+/// group is finished. The scheduler never copies or frees the context.
+typedef void dtTaskFunction(void* context);
+
+/// Counts the unfinished tasks of a batch. Tasks may add more tasks to the
+/// group they belong to. Wait on it with dtTaskScheduler::Wait.
+struct dtTaskGroup
+{
+	dtTaskGroup()
+	{
+		pending = 0;
+	}
+
+	std::atomic<int> pending;
+};
+
+/// A small work stealing task scheduler. Every thread owns a fixed size Chase-Lev
+/// deque. A thread pushes and pops tasks at the bottom of its own deque and steals
+/// from the top of the other deques when it runs dry, so large tasks created early
+/// are stolen first. Queuing, popping and stealing are lock free and do not allocate.
+/// Idle workers sleep on a condition variable, which is only touched when a worker
+/// is asleep.
+/// The thread calling Wait executes tasks until the group is done, so a scheduler
+/// without workers runs everything on the calling thread.
+/// Only one thread outside the scheduler should submit tasks at a time.
+class dtTaskScheduler
+{
+public:
+
+	/// Create workerCount threads in addition to the calling thread. A negative
+	/// count creates one worker per hardware thread, minus one for the caller.
+	explicit dtTaskScheduler(int workerCount = -1);
+	~dtTaskScheduler();
+
+	/// The number of threads executing tasks, including the calling thread.
+	int GetThreadCount() const;
+
+	/// Index of the current thread in [0, GetThreadCount()). Threads outside the
+	/// scheduler get 0. Use this to index per thread scratch memory.
+	int GetThreadIndex() const;
+
+	/// Queue function(context) on the current thread.
+	void Run(dtTaskGroup& group, dtTaskFunction* function, void* context);
+
+	/// Execute tasks until all tasks of the group are finished.
+	void Wait(dtTaskGroup& group);
+
+	/// Split [0, count) into ranges of at least minRange items and call
+	/// function(begin, end) for each range in parallel. The calling thread and up to
+	/// one task per worker claim ranges from a shared atomic counter until none are
+	/// left. Returns when all ranges are done.
+	template <typename F>
+	void ParallelFor(int count, int minRange, const F& function);
+
+private:
+
+	// The fields are atomic because a thief reads a slot that the owner may be
+	// overwriting. The thief then fails its compare exchange and drops the value.
+	struct Entry
+	{
+		std::atomic<dtTaskFunction*> function;
+		std::atomic<void*> context;
+		std::atomic<dtTaskGroup*> group;
+	};
+
+	struct Task
+	{
+		dtTaskFunction* function;
+		void* context;
+		dtTaskGroup* group;
+	};
+
+	struct alignas(64) Queue
+	{
+		std::atomic<int> top;
+		std::atomic<int> bottom;
+		Entry entries[dt_maxQueuedTasks];
+	};
+
+	template <typename F>
+	struct ParallelForContext
+	{
+		const F* function;
+		int count;
+		int rangeSize;
+		std::atomic<int> next;
+	};
+
+	template <typename F>
+	static void ParallelForTask(void* context);
+
+	bool Push(int threadIndex, const Task& task);
+	bool Pop(int threadIndex, Task& task);
+	bool Steal(int threadIndex, Task& task);
+	bool Find(int threadIndex, Task& task);
+	void Execute(const Task& task);
+	void WorkerMain(int threadIndex);
+
+	std::vector<std::thread> m_workers;
+	Queue* m_queues;
+	int m_threadCount;
+
+	std::mutex m_sleepMutex;
+	std::condition_variable m_wake;
+	std::atomic<int> m_queuedCount;
+	std::atomic<int> m_sleeperCount;
+	std::atomic<bool> m_stop;
+};
+
+template <typename F>
+inline void dtTaskScheduler::ParallelForTask(void* context)
+{
+	ParallelForContext<F>* parallelFor = static_cast<ParallelForContext<F>*>(context);
+	int count = parallelFor->count;
+	int rangeSize = parallelFor->rangeSize;
+
+	for (;;)
+	{
+		int begin = parallelFor->next.fetch_add(rangeSize, std::memory_order_relaxed);
+		if (begin >= count)
+		{
+			return;
+		}
+
+		int end = begin + rangeSize < count ? begin + rangeSize : count;
+		(*parallelFor->function)(begin, end);
+	}
+}
+
+template <typename F>
+inline void dtTaskScheduler::ParallelFor(int count, int minRange, const F& function)
+{
+	if (count <= 0)
+	{
+		return;
+	}
+
+	// A few ranges per thread so the counter can even out the load.
+	int rangeSize = (count + 4 * m_threadCount - 1) / (4 * m_threadCount);
+	rangeSize = rangeSize > minRange ? rangeSize : minRange;
+
+	if (m_threadCount == 1 || rangeSize >= count)
+	{
+		function(0, count);
+		return;
+	}
+
+	ParallelForContext<F> context;
+	context.function = &function;
+	context.count = count;
+	context.rangeSize = rangeSize;
+	context.next = 0;
+
+	int rangeCount = (count + rangeSize - 1) / rangeSize;
+	int helperCount = rangeCount - 1 < m_threadCount - 1 ? rangeCount - 1 : m_threadCount - 1;
+
+	dtTaskGroup group;
+	for (int i = 0; i < helperCount; ++i)
+	{
+		Run(group, &ParallelForTask<F>, &context);
+	}
+
+	ParallelForTask<F>(&context);
+	Wait(group);
+}
@@ -12,10 +12,14 @@
 #pragma once
 
 #include "dynamic-tree/utils.h"
+#include <stdint.h>
+#include <algorithm>
 #include <vector>
 
 #define dt_nullNode (-1)
 
+class dtTaskScheduler;
+
 enum dtInsertionHeuristic
 {
 	dt_sah = 0,
@@ -55,16 +59,110 @@ struct dtCandidateNode
 	float inheritanceCost;
 };
 
+/// Ray cast traversal entry. The fraction is where the ray enters the node AABB.
+struct dtRayCastNode
+{
+	int index;
+	float fraction;
+};
+
+#define dt_packetCount 4
+#define dt_packetCount8 8
+
+/// Four rays in SIMD lanes for dtTree::RayCastPacket. Fill it with dtSetRayPacket.
+struct dtRayPacket
+{
+	dtVec originX, originY, originZ;
+	dtVec invDirectionX, invDirectionY, invDirectionZ;
+	dtVec maxFraction;
+
+	/// Bit i is set if lane i holds a ray.
+	int activeMask;
+};
+
+/// Eight rays for dtTree::RayCastPacket8. The arrays are loaded with 256-bit loads
+/// when the processor supports AVX2.
+struct alignas(32) dtRayPacket8
+{
+	float originX[dt_packetCount8], originY[dt_packetCount8], originZ[dt_packetCount8];
+	float invDirectionX[dt_packetCount8], invDirectionY[dt_packetCount8], invDirectionZ[dt_packetCount8];
+	float maxFraction[dt_packetCount8];
+
+	/// Bit i is set if lane i holds a ray.
+	int activeMask;
+};
+
+/// Packet traversal entry. Holds the entry fraction of every ray, FLT_MAX for rays that miss.
+struct dtRayPacketNode
+{
+	dtVec fractions;
+	int index;
+};
+
+struct dtRayPacketNode8
+{
+	float fractions[dt_packetCount8];
+	int index;
+};
+
+/// Put up to four rays into a packet. Rays go from origins[i] to origins[i] + maxFraction * directions[i].
+void dtSetRayPacket(dtRayPacket& packet, const dtVec* origins, const dtVec* directions, int count, float maxFraction);
+
+/// Put up to eight rays into a packet.
+void dtSetRayPacket(dtRayPacket8& packet, const dtVec* origins, const dtVec* directions, int count, float maxFraction);
+
+/// Tree versus tree traversal entry. Both node AABBs overlap.
+struct dtNodePair
+{
+	int indexA;
+	int indexB;
+};
+
+/// Closest object traversal entry. Nodes are keyed by the squared distance to their
+/// AABB and objects by their squared exact distance.
+struct dtClosestNode
+{
+	float distanceSquared;
+	float distance;
+	int index;
+	bool isObject;
+};
+
+#define dt_maxCullPlanes 32
+
+/// Culling traversal entry. Bit i of the mask is set if the node may cross plane i.
+struct dtCullNode
+{
+	int index;
+	uint32_t planeMask;
+};
+
 struct dtCost
 {
 	int node;
 	float cost;
 };
 
+/// Per call timings of the tree internals. Only filled in when tree.cpp is
+/// compiled with DT_PROFILE=1.
+struct dtTreeProfile
+{
+	void Reset()
+	{
+		insertLeaf.Reset();
+		removeLeaf.Reset();
+		rotate.Reset();
+	}
+
+	dtTimerStat insertLeaf;
+	dtTimerStat removeLeaf;
+	dtTimerStat rotate;
+};
+
 /// A dynamic AABB tree broad-phase, inspired by Nathanael Presson's btDbvt.
 /// A dynamic tree arranges data in a binary tree to accelerate
 /// queries such as volume queries and ray casts. Leafs are proxies
-/// with an AABB. In the tree we expand the proxy AABB by b2_fatAABBFactor
+/// with an AABB. In the tree we expand the proxy AABB by m_aabbMargin
 /// so that the proxy AABB is bigger than the client object. This allows the client
 /// object to move by small amounts without triggering a tree update.
 ///
@@ -79,15 +177,135 @@ struct dtTree
 
 	void Clear();
 
+	/// Make this a copy of another tree, reusing the node pool when it is large enough.
+	/// Proxy ids of the other tree are valid in the copy. Scratch state is not copied.
+	void CopyFrom(const dtTree& tree);
+
 	/// Create a proxy. Provide a tight fitting AABB and a userData pointer.
 	int CreateProxy(const dtAABB& aabb, int objectIndex);
 
+	/// Create many proxies at once, such as a streamed tile. The node pool grows at most
+	/// once, the batch is clustered into a subtree with PLOC and the subtree is inserted
+	/// where it adds the least SAH cost. Works best for spatially coherent batches.
+	/// The proxy ids are written to proxies.
+	void CreateProxies(const dtAABB* aabbs, const int* objectIndices, int count, int* proxies);
+
 	/// Destroy a proxy. This asserts if the id is invalid.
 	void DestroyProxy(int proxyId);
 
+	/// Destroy many proxies at once, such as an unloaded tile. The leaves are unlinked
+	/// first and every affected ancestor is refit once afterwards.
+	void DestroyProxies(const int* proxies, int count);
+
+	/// Move a proxy with a swept AABB. If the proxy has moved outside of its fattened AABB,
+	/// then the proxy is removed from the tree and re-inserted. Otherwise
+	/// the function returns immediately. The fat AABB is stretched along the
+	/// predicted displacement.
+	/// @return true if the proxy was re-inserted.
+	bool MoveProxy(int proxyId, const dtAABB& aabb, const dtVec& displacement);
+
+	/// Give many proxies new tight AABBs without changing the topology. The leaves are
+	/// fattened by the margin and every affected internal node is refit once, children
+	/// first. Disjoint subtrees are refit in parallel if a scheduler is given. This is
+	/// much cheaper than MoveProxy for coherent motion, but the tree quality degrades
+	/// as objects drift apart, so pair it with Optimize or a rebuild.
+	void Refit(const int* proxies, const dtAABB* aabbs, int count, dtTaskScheduler* scheduler = nullptr);
+
 	/// Get the fat AABB for a proxy.
 	const dtAABB& GetAABB(int proxyId) const;
 
+	/// Query an AABB for overlapping proxies. The callback is called for each
+	/// proxy that overlaps the supplied AABB:
+	/// bool QueryCallback(int proxyId)
+	/// Return false to terminate the query. This never allocates unless the
+	/// tree is extremely deep.
+	template <typename T>
+	void Query(const dtAABB& aabb, T* callback) const;
+
+	/// Ray cast against the proxies in the tree. The ray extends from origin to
+	/// origin + maxFraction * direction. Children are visited nearest first and the
+	/// ray is clipped by the fractions reported from the callback, so the closest hit
+	/// is usually found after visiting few nodes. This never allocates unless the
+	/// tree is extremely deep.
+	/// The callback performs the exact ray cast against the client object:
+	/// float RayCastCallback(const dtVec& origin, const dtVec& direction, float maxFraction, int proxyId)
+	/// Return 0 to terminate the ray cast, a negative value to ignore the proxy,
+	/// or the hit fraction to clip the ray.
+	template <typename T>
+	void RayCast(const dtVec& origin, const dtVec& direction, float maxFraction, T* callback) const;
+
+	/// Find all pairs of overlapping proxies between this tree and another tree, such
+	/// as dynamic objects against static geometry kept in its own tree. Both trees are
+	/// descended together, splitting the larger node of each overlapping pair, so
+	/// subtrees that do not overlap are skipped in one box test.
+	/// The callback is called for each pair with the proxy of this tree first:
+	/// bool QueryPairCallback(int proxyIdA, int proxyIdB)
+	/// Return false to stop the query.
+	template <typename T>
+	void QueryTree(const dtTree& tree, T* callback) const;
+
+	/// Find all pairs of overlapping proxies within this tree, such as for the first
+	/// pair update after loading a level. Every node is paired with itself and its
+	/// two children are descended against each other, so each pair is found exactly
+	/// once without per proxy queries. The callback receives the smaller proxy id first:
+	/// bool QueryPairCallback(int proxyIdA, int proxyIdB)
+	/// Return false to stop the query.
+	template <typename T>
+	void FindAllPairs(T* callback) const;
+
+	/// Find the k proxies closest to a point within maxDistance, nearest first. Nodes
+	/// are visited best first by their AABB distance, so the search ends as soon as the
+	/// k-th object is closer than every unvisited node.
+	/// The callback computes the exact distance to the client object and receives the
+	/// results in order of increasing distance:
+	/// float DistanceCallback(const dtVec& point, int proxyId)
+	/// void ClosestCallback(int proxyId, float distance)
+	/// Return a negative distance to ignore a proxy. The exact distance must not be less
+	/// than the distance to the proxy AABB, which holds for objects inside their AABB.
+	/// @return the number of objects reported.
+	template <typename T>
+	int ClosestObjects(const dtVec& point, int k, float maxDistance, T* callback) const;
+
+	/// Sweep a box along a translation against the proxies in the tree, such as for
+	/// continuous collision of fast objects. Each node AABB is grown by the half
+	/// extents of the box and ray cast from the box center, so this visits children
+	/// in time of impact order and clips like RayCast.
+	/// The callback performs the exact cast against the client object:
+	/// float ShapeCastCallback(const dtAABB& box, const dtVec& translation, float maxFraction, int proxyId)
+	/// Return 0 to terminate the cast, a negative value to ignore the proxy,
+	/// or the time of impact fraction to clip the cast.
+	template <typename T>
+	void ShapeCast(const dtAABB& box, const dtVec& translation, float maxFraction, T* callback) const;
+
+	/// Find the proxies whose AABB is not fully outside a convex volume, such as a view
+	/// frustum, given by up to 32 planes with outward normals. A node fully inside a
+	/// plane is not tested against that plane in its subtree, and a subtree fully inside
+	/// all planes is reported without further tests. Proxies cutting a plane are reported
+	/// and may still be outside the volume near its corners.
+	/// The callback is the same as for Query:
+	/// bool QueryCallback(int proxyId)
+	/// Return false to stop the query.
+	template <typename T>
+	void CullFrustum(const dtPlane* planes, int count, T* callback) const;
+
+	/// Ray cast a packet of coherent rays, such as shadow or sensor rays, so each node
+	/// is fetched once for all rays. A node is skipped only when every active ray misses
+	/// it and every ray is clipped on its own. Incoherent rays are faster with RayCast.
+	/// The callback is called for each ray that hits a proxy AABB:
+	/// float RayPacketCallback(int rayIndex, float maxFraction, int proxyId)
+	/// Return 0 to terminate that ray, a negative value to ignore the proxy,
+	/// or the hit fraction to clip that ray.
+	template <typename T>
+	void RayCastPacket(const dtRayPacket& packet, T* callback) const;
+
+	/// Same as RayCastPacket for eight rays. Uses AVX2 if available, otherwise the
+	/// packet is cast as two packets of four.
+	template <typename T>
+	void RayCastPacket8(const dtRayPacket8& packet, T* callback) const;
+
+	template <typename T>
+	DT_TARGET_AVX2 void RayCastPacketAVX2(const dtRayPacket8& packet, T* callback) const;
+
 	/// Validate this tree. For testing.
 	void Validate() const;
 
@@ -110,26 +328,55 @@ struct dtTree
 	/// Build an optimal tree. Very expensive. For testing.
 	void RebuildBottomUp();
 
+	/// Rebuild the tree bottom up with locally ordered clustering (PLOC). This reaches
+	/// trees close to RebuildBottomUp in about O(n log n) time. Clusters search for
+	/// merge partners among the radius clusters on either side in Morton order.
+	/// The neighbor search runs in parallel if a scheduler is given. Proxy ids are kept.
+	void RebuildPLOC(int radius = 16, dtTaskScheduler* scheduler = nullptr);
+
+	/// Cluster the given nodes into a subtree with PLOC and return its root. The nodes
+	/// must have no parent. The array is used as scratch space. Returns dt_nullNode
+	/// if count is zero.
+	int BuildPLOC(int* nodes, int count, int radius, dtTaskScheduler* scheduler);
+
 	/// Build top down using SAH
 	void BuildTopDownSAH(int* proxies, dtAABB* aabbs, int count);
 	int BinSortBoxes(int parentIndex, dtNode* leaves, int count, struct dtTreeBin* bins, struct dtTreePlane* planes);
 
+	/// Build top down using SAH on several threads. Large nodes are binned in parallel
+	/// and subtrees are built as tasks. Produces the same splits as BuildTopDownSAH.
+	void BuildTopDownSAHParallel(int* proxies, dtAABB* aabbs, int count, dtTaskScheduler& scheduler);
+
 	/// Build top down using the median split
 	void BuildTopDownMedianSplit(int* proxies, dtAABB* aabbs, int count);
 	int PartitionBoxes(int parentIndex, dtNode* leaves, int count);
 
+	/// Build a linear BVH. The leaves are sorted by the Morton codes of their centers and
+	/// the hierarchy is emitted in one pass over the sorted codes. This is much faster
+	/// than the top down builders and gives lower quality trees. Unlike the other
+	/// builders this keeps the node pool when it is large enough, so it can be used
+	/// to rebuild the tree every step.
+	void BuildLBVH(int* proxies, dtAABB* aabbs, int count);
+
 	void WriteDot(const char* fileName) const;
 
+	void ReserveNodes(int count);
 	int AllocateNode();
 	void FreeNode(int node);
 
 	void InsertLeaf(int leaf);
 	void InsertLeafSAH(int leaf);
-	void InsertLeafBittner(int leaf);
+	float InsertLeafBittner(int leaf);
 	void InsertLeafApproxSAH(int leaf);
 	void InsertLeafManhattan(int leaf);
 	void RemoveLeaf(int leaf);
 
+	/// Split the larger node of an overlapping pair of disjoint subtrees and push the
+	/// child pairs that still overlap. Shared by QueryTree and FindAllPairs.
+	static void DescendPair(const dtNode* nodesA, const dtNode* nodesB, const dtNodePair& pair,
+		dtGrowableStack<dtNodePair, 256>& stack);
+	void RefitAncestors(const int* nodes, int count, dtTaskScheduler* scheduler);
+
 	dtCost MinCost(int index, const dtAABB& box);
 
 	float SiblingCost(const dtAABB& aabbL, int sibling);
@@ -141,6 +388,22 @@ struct dtTree
 	void Optimize(int iterations);
 	void Shuffle(int index);
 
+	/// Restructure treelets of up to 7 leaves into the topology with the least internal
+	/// node area, found by dynamic programming over the leaf subsets. Internal nodes are
+	/// processed bottom up and later calls continue where the last call stopped, so this
+	/// can run between steps. Stops after iterations treelets or, if maxMilliseconds is
+	/// positive, after that much time. Returns the number of treelets that changed.
+	int OptimizeTreelets(int iterations, float maxMilliseconds = 0.0f);
+	bool RestructureTreelet(int index);
+
+	/// Recover the quality of a degraded tree by removing the internal nodes with the
+	/// largest area relative to their children and reinserting their two subtrees with
+	/// the dt_bittner branch and bound search. Each pass ranks all internal nodes and
+	/// reinserts the worst batchFraction of them. A reinsertion that does not reduce the
+	/// total area is undone. Runs until maxMilliseconds have passed or a pass keeps no
+	/// reinsertion. Returns the number of kept reinsertions.
+	int OptimizeReinsertion(float maxMilliseconds, float batchFraction = 0.01f);
+
 	int ComputeHeight() const;
 	int ComputeHeight(int nodeId) const;
 
@@ -164,10 +427,801 @@ struct dtTree
 	/// This is used to incrementally traverse the tree for re-balancing.
 	int m_path;
 
+	/// Internal nodes ordered by height for OptimizeTreelets and the next one to visit.
+	std::vector<int> m_treeletQueue;
+	int m_treeletCursor;
+
 	int m_insertionCount;
 
 	dtInsertionHeuristic m_heuristic;
+
+	/// Proxy AABBs are enlarged by this margin so small motions do not need a tree update.
+	float m_aabbMargin;
+
+	/// The fat AABB is extended by this multiple of the displacement given to MoveProxy.
+	float m_aabbMultiplier;
 	
 	std::vector<dtCandidateNode> m_heap;
 	int m_maxHeapCount;
+
+	/// Scratch space of the linear builders, kept so rebuilding every frame does not allocate.
+	std::vector<uint32_t> m_mortonCodes;
+	std::vector<uint32_t> m_mortonScratch;
+	std::vector<int> m_buildOrder;
+	std::vector<int> m_buildScratch;
+
+	/// Scratch space of Refit and DestroyProxies. A node is marked for refitting when its
+	/// entry equals m_refitGeneration, so the marks never need to be cleared.
+	std::vector<int> m_refitNodes;
+	std::vector<uint32_t> m_refitMarks;
+	uint32_t m_refitGeneration;
+
+	dtTreeProfile m_profile;
 };
+
+template <typename T>
+inline void dtTree::Query(const dtAABB& aabb, T* callback) const
+{
+	if (m_root == dt_nullNode)
+	{
+		return;
+	}
+
+	dtGrowableStack<int, 256> stack;
+	stack.Push(m_root);
+
+	while (stack.GetCount() > 0)
+	{
+		int nodeId = stack.Pop();
+		const dtNode* node = m_nodes + nodeId;
+
+		if (dtTestOverlap(node->aabb, aabb) == false)
+		{
+			continue;
+		}
+
+		if (node->isLeaf)
+		{
+			bool proceed = callback->QueryCallback(nodeId);
+			if (proceed == false)
+			{
+				return;
+			}
+		}
+		else
+		{
+			stack.Push(node->child1);
+			stack.Push(node->child2);
+		}
+	}
+}
+
+template <typename T>
+inline void dtTree::RayCast(const dtVec& origin, const dtVec& direction, float maxFraction, T* callback) const
+{
+	if (m_root == dt_nullNode)
+	{
+		return;
+	}
+
+	dtVec invDirection = dtRayInverse(direction);
+
+	dtRayCastNode entry;
+	entry.index = m_root;
+	entry.fraction = dtRayCastAABB(m_nodes[m_root].aabb, origin, invDirection, maxFraction);
+	if (entry.fraction == FLT_MAX)
+	{
+		return;
+	}
+
+	dtGrowableStack<dtRayCastNode, 256> stack;
+	stack.Push(entry);
+
+	while (stack.GetCount() > 0)
+	{
+		entry = stack.Pop();
+		if (entry.fraction > maxFraction)
+		{
+			// The ray was clipped after this node was pushed.
+			continue;
+		}
+
+		const dtNode* node = m_nodes + entry.index;
+
+		if (node->isLeaf)
+		{
+			float value = callback->RayCastCallback(origin, direction, maxFraction, entry.index);
+
+			if (value == 0.0f)
+			{
+				// The client has terminated the ray cast.
+				return;
+			}
+
+			if (value > 0.0f)
+			{
+				// Clip the ray.
+				maxFraction = dtMin(value, maxFraction);
+			}
+
+			continue;
+		}
+
+		dtRayCastNode entry1;
+		entry1.index = node->child1;
+		entry1.fraction = dtRayCastAABB(m_nodes[node->child1].aabb, origin, invDirection, maxFraction);
+
+		dtRayCastNode entry2;
+		entry2.index = node->child2;
+		entry2.fraction = dtRayCastAABB(m_nodes[node->child2].aabb, origin, invDirection, maxFraction);
+
+		// Push the far child first so the near child is popped first.
+		if (entry2.fraction < entry1.fraction)
+		{
+			dtSwap(entry1, entry2);
+		}
+
+		if (entry2.fraction != FLT_MAX)
+		{
+			stack.Push(entry2);
+		}
+
+		if (entry1.fraction != FLT_MAX)
+		{
+			stack.Push(entry1);
+		}
+	}
+}
+
+inline void dtTree::DescendPair(const dtNode* nodesA, const dtNode* nodesB, const dtNodePair& pair,
+	dtGrowableStack<dtNodePair, 256>& stack)
+{
+	const dtNode* nodeA = nodesA + pair.indexA;
+	const dtNode* nodeB = nodesB + pair.indexB;
+
+	// Split the larger node so the pair boxes shrink as fast as possible.
+	bool splitA = nodeB->isLeaf || (nodeA->isLeaf == false && dtArea(nodeA->aabb) >= dtArea(nodeB->aabb));
+
+	if (splitA)
+	{
+		const dtAABB& aabbB = nodeB->aabb;
+		if (dtTestOverlap(nodesA[nodeA->child1].aabb, aabbB))
+		{
+			stack.Push({ nodeA->child1, pair.indexB });
+		}
+
+		if (dtTestOverlap(nodesA[nodeA->child2].aabb, aabbB))
+		{
+			stack.Push({ nodeA->child2, pair.indexB });
+		}
+	}
+	else
+	{
+		const dtAABB& aabbA = nodeA->aabb;
+		if (dtTestOverlap(aabbA, nodesB[nodeB->child1].aabb))
+		{
+			stack.Push({ pair.indexA, nodeB->child1 });
+		}
+
+		if (dtTestOverlap(aabbA, nodesB[nodeB->child2].aabb))
+		{
+			stack.Push({ pair.indexA, nodeB->child2 });
+		}
+	}
+}
+
+template <typename T>
+inline void dtTree::QueryTree(const dtTree& tree, T* callback) const
+{
+	if (m_root == dt_nullNode || tree.m_root == dt_nullNode)
+	{
+		return;
+	}
+
+	if (dtTestOverlap(m_nodes[m_root].aabb, tree.m_nodes[tree.m_root].aabb) == false)
+	{
+		return;
+	}
+
+	const dtNode* nodesB = tree.m_nodes;
+
+	dtGrowableStack<dtNodePair, 256> stack;
+	stack.Push({ m_root, tree.m_root });
+
+	while (stack.GetCount() > 0)
+	{
+		dtNodePair pair = stack.Pop();
+		const dtNode* nodeA = m_nodes + pair.indexA;
+		const dtNode* nodeB = nodesB + pair.indexB;
+
+		if (nodeA->isLeaf && nodeB->isLeaf)
+		{
+			bool proceed = callback->QueryPairCallback(pair.indexA, pair.indexB);
+			if (proceed == false)
+			{
+				return;
+			}
+
+			continue;
+		}
+
+		DescendPair(m_nodes, nodesB, pair, stack);
+	}
+}
+
+template <typename T>
+inline void dtTree::FindAllPairs(T* callback) const
+{
+	if (m_root == dt_nullNode)
+	{
+		return;
+	}
+
+	// Entries with equal indices pair a subtree with itself.
+	dtGrowableStack<dtNodePair, 256> stack;
+	stack.Push({ m_root, m_root });
+
+	while (stack.GetCount() > 0)
+	{
+		dtNodePair pair = stack.Pop();
+		const dtNode* nodeA = m_nodes + pair.indexA;
+		const dtNode* nodeB = m_nodes + pair.indexB;
+
+		if (pair.indexA == pair.indexB)
+		{
+			if (nodeA->isLeaf)
+			{
+				continue;
+			}
+
+			stack.Push({ nodeA->child1, nodeA->child1 });
+			stack.Push({ nodeA->child2, nodeA->child2 });
+
+			if (dtTestOverlap(m_nodes[nodeA->child1].aabb, m_nodes[nodeA->child2].aabb))
+			{
+				stack.Push({ nodeA->child1, nodeA->child2 });
+			}
+
+			continue;
+		}
+
+		if (nodeA->isLeaf && nodeB->isLeaf)
+		{
+			int proxyIdA = dtMin(pair.indexA, pair.indexB);
+			int proxyIdB = dtMax(pair.indexA, pair.indexB);
+			bool proceed = callback->QueryPairCallback(proxyIdA, proxyIdB);
+			if (proceed == false)
+			{
+				return;
+			}
+
+			continue;
+		}
+
+		// The subtrees are disjoint, so this is the same descent as QueryTree.
+		DescendPair(m_nodes, m_nodes, pair, stack);
+	}
+}
+
+template <typename T>
+inline int dtTree::ClosestObjects(const dtVec& point, int k, float maxDistance, T* callback) const
+{
+	if (m_root == dt_nullNode || k <= 0)
+	{
+		return 0;
+	}
+
+	float maxDistanceSquared = maxDistance * maxDistance;
+
+	dtClosestNode entry;
+	entry.distanceSquared = dtDistanceSquared(m_nodes[m_root].aabb, point);
+	entry.distance = 0.0f;
+	entry.index = m_root;
+	entry.isObject = false;
+	if (entry.distanceSquared > maxDistanceSquared)
+	{
+		return 0;
+	}
+
+	// Reversed so the standard heap functions keep the nearest entry on top.
+	auto farther = [](const dtClosestNode& a, const dtClosestNode& b) { return a.distanceSquared > b.distanceSquared; };
+
+	// A binary heap kept in the stack storage so small searches do not allocate.
+	dtGrowableStack<dtClosestNode, 256> heap;
+	heap.Push(entry);
+
+	int count = 0;
+	while (heap.GetCount() > 0)
+	{
+		std::pop_heap(heap.GetData(), heap.GetData() + heap.GetCount(), farther);
+		entry = heap.Pop();
+
+		if (entry.isObject)
+		{
+			// Every remaining node and object is at least this far away.
+			callback->ClosestCallback(entry.index, entry.distance);
+			++count;
+			if (count == k)
+			{
+				break;
+			}
+
+			continue;
+		}
+
+		const dtNode* node = m_nodes + entry.index;
+
+		if (node->isLeaf)
+		{
+			float distance = callback->DistanceCallback(point, entry.index);
+			if (distance < 0.0f || distance > maxDistance)
+			{
+				continue;
+			}
+
+			// The object goes back in the heap in case a nearer object is still in an unvisited node.
+			dtClosestNode object;
+			object.distanceSquared = dtMax(distance * distance, entry.distanceSquared);
+			object.distance = distance;
+			object.index = entry.index;
+			object.isObject = true;
+			heap.Push(object);
+			std::push_heap(heap.GetData(), heap.GetData() + heap.GetCount(), farther);
+			continue;
+		}
+
+		int children[2] = { node->child1, node->child2 };
+		for (int i = 0; i < 2; ++i)
+		{
+			dtClosestNode child;
+			child.distanceSquared = dtDistanceSquared(m_nodes[children[i]].aabb, point);
+			child.distance = 0.0f;
+			child.index = children[i];
+			child.isObject = false;
+
+			if (child.distanceSquared <= maxDistanceSquared)
+			{
+				heap.Push(child);
+				std::push_heap(heap.GetData(), heap.GetData() + heap.GetCount(), farther);
+			}
+		}
+	}
+
+	return count;
+}
+
+// Fraction where a box swept from its center hits an AABB, FLT_MAX if it misses.
+inline float dtShapeCastAABB(const dtAABB& a, const dtVec& extent, const dtVec& center, const dtVec& invTranslation, float maxFraction)
+{
+	dtAABB inflated;
+	inflated.lowerBound = a.lowerBound - extent;
+	inflated.upperBound = a.upperBound + extent;
+	return dtRayCastAABB(inflated, center, invTranslation, maxFraction);
+}
+
+template <typename T>
+inline void dtTree::ShapeCast(const dtAABB& box, const dtVec& translation, float maxFraction, T* callback) const
+{
+	if (m_root == dt_nullNode)
+	{
+		return;
+	}
+
+	dtVec center = dtCenter(box);
+	dtVec extent = dtExtent(box);
+	dtVec invTranslation = dtRayInverse(translation);
+
+	dtRayCastNode entry;
+	entry.index = m_root;
+	entry.fraction = dtShapeCastAABB(m_nodes[m_root].aabb, extent, center, invTranslation, maxFraction);
+	if (entry.fraction == FLT_MAX)
+	{
+		return;
+	}
+
+	dtGrowableStack<dtRayCastNode, 256> stack;
+	stack.Push(entry);
+
+	while (stack.GetCount() > 0)
+	{
+		entry = stack.Pop();
+		if (entry.fraction > maxFraction)
+		{
+			// The cast was clipped after this node was pushed.
+			continue;
+		}
+
+		const dtNode* node = m_nodes + entry.index;
+
+		if (node->isLeaf)
+		{
+			float value = callback->ShapeCastCallback(box, translation, maxFraction, entry.index);
+
+			if (value == 0.0f)
+			{
+				// The client has terminated the cast.
+				return;
+			}
+
+			if (value > 0.0f)
+			{
+				// Clip the cast.
+				maxFraction = dtMin(value, maxFraction);
+			}
+
+			continue;
+		}
+
+		dtRayCastNode entry1;
+		entry1.index = node->child1;
+		entry1.fraction = dtShapeCastAABB(m_nodes[node->child1].aabb, extent, center, invTranslation, maxFraction);
+
+		dtRayCastNode entry2;
+		entry2.index = node->child2;
+		entry2.fraction = dtShapeCastAABB(m_nodes[node->child2].aabb, extent, center, invTranslation, maxFraction);
+
+		// Push the later child first so the earlier impact is popped first.
+		if (entry2.fraction < entry1.fraction)
+		{
+			dtSwap(entry1, entry2);
+		}
+
+		if (entry2.fraction != FLT_MAX)
+		{
+			stack.Push(entry2);
+		}
+
+		if (entry1.fraction != FLT_MAX)
+		{
+			stack.Push(entry1);
+		}
+	}
+}
+
+template <typename T>
+inline void dtTree::CullFrustum(const dtPlane* planes, int count, T* callback) const
+{
+	assert(0 <= count && count <= dt_maxCullPlanes);
+
+	if (m_root == dt_nullNode)
+	{
+		return;
+	}
+
+	uint32_t allPlanes = count == dt_maxCullPlanes ? 0xFFFFFFFFu : (1u << count) - 1u;
+
+	dtGrowableStack<dtCullNode, 256> stack;
+	stack.Push({ m_root, allPlanes });
+
+	while (stack.GetCount() > 0)
+	{
+		dtCullNode entry = stack.Pop();
+		const dtNode* node = m_nodes + entry.index;
+
+		uint32_t planeMask = entry.planeMask;
+		bool outside = false;
+		for (int i = 0; i < count && planeMask != 0; ++i)
+		{
+			if ((planeMask & (1u << i)) == 0)
+			{
+				continue;
+			}
+
+			int side = dtClassifyAABB(node->aabb, planes[i]);
+			if (side > 0)
+			{
+				outside = true;
+				break;
+			}
+
+			if (side < 0)
+			{
+				// Children are inside this plane as well.
+				planeMask &= ~(1u << i);
+			}
+		}
+
+		if (outside)
+		{
+			continue;
+		}
+
+		if (node->isLeaf)
+		{
+			bool proceed = callback->QueryCallback(entry.index);
+			if (proceed == false)
+			{
+				return;
+			}
+		}
+		else
+		{
+			stack.Push({ node->child1, planeMask });
+			stack.Push({ node->child2, planeMask });
+		}
+	}
+}
+
+// Slab test of four rays against one AABB. Returns the entry fraction per ray and
+// FLT_MAX for rays that miss.
+inline dtVec dtRayCastPacketAABB(const dtAABB& a, const dtRayPacket& packet, const dtVec& maxFraction)
+{
+	dtVec lowerX = _mm_shuffle_ps(a.lowerBound, a.lowerBound, _MM_SHUFFLE(0, 0, 0, 0));
+	dtVec lowerY = _mm_shuffle_ps(a.lowerBound, a.lowerBound, _MM_SHUFFLE(1, 1, 1, 1));
+	dtVec lowerZ = _mm_shuffle_ps(a.lowerBound, a.lowerBound, _MM_SHUFFLE(2, 2, 2, 2));
+	dtVec upperX = _mm_shuffle_ps(a.upperBound, a.upperBound, _MM_SHUFFLE(0, 0, 0, 0));
+	dtVec upperY = _mm_shuffle_ps(a.upperBound, a.upperBound, _MM_SHUFFLE(1, 1, 1, 1));
+	dtVec upperZ = _mm_shuffle_ps(a.upperBound, a.upperBound, _MM_SHUFFLE(2, 2, 2, 2));
+
+	dtVec x1 = _mm_mul_ps(_mm_sub_ps(lowerX, packet.originX), packet.invDirectionX);
+	dtVec x2 = _mm_mul_ps(_mm_sub_ps(upperX, packet.originX), packet.invDirectionX);
+	dtVec y1 = _mm_mul_ps(_mm_sub_ps(lowerY, packet.originY), packet.invDirectionY);
+	dtVec y2 = _mm_mul_ps(_mm_sub_ps(upperY, packet.originY), packet.invDirectionY);
+	dtVec z1 = _mm_mul_ps(_mm_sub_ps(lowerZ, packet.originZ), packet.invDirectionZ);
+	dtVec z2 = _mm_mul_ps(_mm_sub_ps(upperZ, packet.originZ), packet.invDirectionZ);
+
+	dtVec tmin = _mm_max_ps(_mm_max_ps(_mm_min_ps(x1, x2), _mm_min_ps(y1, y2)), _mm_max_ps(_mm_min_ps(z1, z2), _mm_setzero_ps()));
+	dtVec tmax = _mm_min_ps(_mm_min_ps(_mm_max_ps(x1, x2), _mm_max_ps(y1, y2)), _mm_min_ps(_mm_max_ps(z1, z2), maxFraction));
+
+	dtVec hit = _mm_cmple_ps(tmin, tmax);
+	return _mm_or_ps(_mm_and_ps(hit, tmin), _mm_andnot_ps(hit, dtSplat(FLT_MAX)));
+}
+
+inline float dtMinLane(const dtVec& v)
+{
+	dtVec m = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+	m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+	return dtGetX(m);
+}
+
+template <typename T>
+inline void dtTree::RayCastPacket(const dtRayPacket& packet, T* callback) const
+{
+	int activeMask = packet.activeMask & 0xF;
+	if (m_root == dt_nullNode || activeMask == 0)
+	{
+		return;
+	}
+
+	// Clipped per ray by the callback.
+	alignas(16) float maxFractions[dt_packetCount];
+	_mm_store_ps(maxFractions, packet.maxFraction);
+	dtVec maxFraction = packet.maxFraction;
+
+	dtRayPacketNode entry;
+	entry.index = m_root;
+	entry.fractions = dtRayCastPacketAABB(m_nodes[m_root].aabb, packet, maxFraction);
+
+	dtGrowableStack<dtRayPacketNode, 256> stack;
+	stack.Push(entry);
+
+	while (stack.GetCount() > 0)
+	{
+		entry = stack.Pop();
+
+		// Rays that still reach the node. Rays may have been clipped after the push.
+		int mask = _mm_movemask_ps(_mm_cmple_ps(entry.fractions, maxFraction)) & activeMask;
+		if (mask == 0)
+		{
+			continue;
+		}
+
+		const dtNode* node = m_nodes + entry.index;
+
+		if (node->isLeaf)
+		{
+			for (int i = 0; i < dt_packetCount; ++i)
+			{
+				if ((mask & (1 << i)) == 0)
+				{
+					continue;
+				}
+
+				float value = callback->RayPacketCallback(i, maxFractions[i], entry.index);
+
+				if (value == 0.0f)
+				{
+					// The client has terminated this ray.
+					activeMask &= ~(1 << i);
+				}
+				else if (value > 0.0f)
+				{
+					// Clip the ray.
+					maxFractions[i] = dtMin(value, maxFractions[i]);
+				}
+			}
+
+			if (activeMask == 0)
+			{
+				return;
+			}
+
+			maxFraction = _mm_load_ps(maxFractions);
+			continue;
+		}
+
+		dtRayPacketNode entry1;
+		entry1.index = node->child1;
+		entry1.fractions = dtRayCastPacketAABB(m_nodes[node->child1].aabb, packet, maxFraction);
+
+		dtRayPacketNode entry2;
+		entry2.index = node->child2;
+		entry2.fractions = dtRayCastPacketAABB(m_nodes[node->child2].aabb, packet, maxFraction);
+
+		// Push the far child first so the child entered first by any ray is popped first.
+		float fraction1 = dtMinLane(entry1.fractions);
+		float fraction2 = dtMinLane(entry2.fractions);
+		if (fraction2 < fraction1)
+		{
+			dtSwap(entry1, entry2);
+			dtSwap(fraction1, fraction2);
+		}
+
+		if (fraction2 != FLT_MAX)
+		{
+			stack.Push(entry2);
+		}
+
+		if (fraction1 != FLT_MAX)
+		{
+			stack.Push(entry1);
+		}
+	}
+}
+
+// Presents the upper half of an eight ray packet as rays 4 to 7.
+template <typename T>
+struct dtRayPacketHalf
+{
+	float RayPacketCallback(int rayIndex, float maxFraction, int proxyId)
+	{
+		return callback->RayPacketCallback(rayIndex + offset, maxFraction, proxyId);
+	}
+
+	T* callback;
+	int offset;
+};
+
+template <typename T>
+inline void dtTree::RayCastPacket8(const dtRayPacket8& packet, T* callback) const
+{
+	if (dtHasAVX2())
+	{
+		RayCastPacketAVX2(packet, callback);
+		return;
+	}
+
+	for (int half = 0; half < 2; ++half)
+	{
+		int offset = dt_packetCount * half;
+
+		dtRayPacket packet4;
+		packet4.originX = _mm_load_ps(packet.originX + offset);
+		packet4.originY = _mm_load_ps(packet.originY + offset);
+		packet4.originZ = _mm_load_ps(packet.originZ + offset);
+		packet4.invDirectionX = _mm_load_ps(packet.invDirectionX + offset);
+		packet4.invDirectionY = _mm_load_ps(packet.invDirectionY + offset);
+		packet4.invDirectionZ = _mm_load_ps(packet.invDirectionZ + offset);
+		packet4.maxFraction = _mm_load_ps(packet.maxFraction + offset);
+		packet4.activeMask = (packet.activeMask >> offset) & 0xF;
+
+		dtRayPacketHalf<T> halfCallback;
+		halfCallback.callback = callback;
+		halfCallback.offset = offset;
+		RayCastPacket(packet4, &halfCallback);
+	}
+}
+
+// Slab test of eight rays against one AABB. Writes the entry fraction per ray, FLT_MAX
+// for rays that miss, and returns the smallest entry fraction.
+DT_TARGET_AVX2 inline float dtRayCastPacketAABB(const dtAABB& a, const dtRayPacket8& packet, __m256 maxFraction, float* fractions)
+{
+	alignas(16) float lower[4], upper[4];
+	_mm_store_ps(lower, a.lowerBound);
+	_mm_store_ps(upper, a.upperBound);
+
+	__m256 x1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(lower[0]), _mm256_load_ps(packet.originX)), _mm256_load_ps(packet.invDirectionX));
+	__m256 x2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(upper[0]), _mm256_load_ps(packet.originX)), _mm256_load_ps(packet.invDirectionX));
+	__m256 y1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(lower[1]), _mm256_load_ps(packet.originY)), _mm256_load_ps(packet.invDirectionY));
+	__m256 y2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(upper[1]), _mm256_load_ps(packet.originY)), _mm256_load_ps(packet.invDirectionY));
+	__m256 z1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(lower[2]), _mm256_load_ps(packet.originZ)), _mm256_load_ps(packet.invDirectionZ));
+	__m256 z2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(upper[2]), _mm256_load_ps(packet.originZ)), _mm256_load_ps(packet.invDirectionZ));
+
+	__m256 tmin = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(x1, x2), _mm256_min_ps(y1, y2)), _mm256_max_ps(_mm256_min_ps(z1, z2), _mm256_setzero_ps()));
+	__m256 tmax = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(x1, x2), _mm256_max_ps(y1, y2)), _mm256_min_ps(_mm256_max_ps(z1, z2), maxFraction));
+	__m256 result = _mm256_blendv_ps(_mm256_set1_ps(FLT_MAX), tmin, _mm256_cmp_ps(tmin, tmax, _CMP_LE_OQ));
+	_mm256_storeu_ps(fractions, result);
+
+	__m256 m = _mm256_min_ps(result, _mm256_permute2f128_ps(result, result, 1));
+	m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+	m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+	return _mm256_cvtss_f32(m);
+}
+
+template <typename T>
+DT_TARGET_AVX2 inline void dtTree::RayCastPacketAVX2(const dtRayPacket8& packet, T* callback) const
+{
+	int activeMask = packet.activeMask & 0xFF;
+	if (m_root == dt_nullNode || activeMask == 0)
+	{
+		return;
+	}
+
+	alignas(32) float maxFractions[dt_packetCount8];
+	__m256 maxFraction = _mm256_load_ps(packet.maxFraction);
+	_mm256_store_ps(maxFractions, maxFraction);
+
+	dtRayPacketNode8 entry;
+	entry.index = m_root;
+	dtRayCastPacketAABB(m_nodes[m_root].aabb, packet, maxFraction, entry.fractions);
+
+	dtGrowableStack<dtRayPacketNode8, 128> stack;
+	stack.Push(entry);
+
+	while (stack.GetCount() > 0)
+	{
+		entry = stack.Pop();
+
+		int mask = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(entry.fractions), maxFraction, _CMP_LE_OQ)) & activeMask;
+		if (mask == 0)
+		{
+			continue;
+		}
+
+		const dtNode* node = m_nodes + entry.index;
+
+		if (node->isLeaf)
+		{
+			for (int i = 0; i < dt_packetCount8; ++i)
+			{
+				if ((mask & (1 << i)) == 0)
+				{
+					continue;
+				}
+
+				float value = callback->RayPacketCallback(i, maxFractions[i], entry.index);
+
+				if (value == 0.0f)
+				{
+					activeMask &= ~(1 << i);
+				}
+				else if (value > 0.0f)
+				{
+					maxFractions[i] = dtMin(value, maxFractions[i]);
+				}
+			}
+
+			if (activeMask == 0)
+			{
+				return;
+			}
+
+			maxFraction = _mm256_load_ps(maxFractions);
+			continue;
+		}
+
+		dtRayPacketNode8 entry1;
+		entry1.index = node->child1;
+		float fraction1 = dtRayCastPacketAABB(m_nodes[node->child1].aabb, packet, maxFraction, entry1.fractions);
+
+		dtRayPacketNode8 entry2;
+		entry2.index = node->child2;
+		float fraction2 = dtRayCastPacketAABB(m_nodes[node->child2].aabb, packet, maxFraction, entry2.fractions);
+
+		if (fraction2 < fraction1)
+		{
+			dtSwap(entry1, entry2);
+			dtSwap(fraction1, fraction2);
+		}
+
+		if (fraction2 != FLT_MAX)
+		{
+			stack.Push(entry2);
+		}
+
+		if (fraction1 != FLT_MAX)
+		{
+			stack.Push(entry1);
+		}
+	}
+}
@@ -0,0 +1,64 @@
+/*
+* Copyright (c) 2019 Erin Catto http://www.box2d.org
+*
+* Permission to use, copy, modify, distribute and sell this software
+* and its documentation for any purpose is hereby granted without fee,
+* provided that the above copyright notice appear in all copies.
+* Erin Catto makes no representations about the suitability
+* of this software for any purpose.
+* It is provided "as is" without express or implied warranty.
+*/
+
+#pragma once
+
+#include "dynamic-tree/tree.h"
+#include <atomic>
+
+/// The most snapshot buffers a publisher will allocate.
+#define dt_maxSnapshotBuffers 8
+
+/// Publishes immutable copies of a tree so other threads can query it while the
+/// owner keeps updating it. The writer calls Publish when the tree is in a state
+/// worth sharing, such as the end of a step. Readers call Acquire, query the
+/// returned snapshot and hand it back with Release. Acquire and Release are lock
+/// free: the current snapshot is an atomic buffer index and each buffer counts its
+/// readers. Readers never wait on the writer and never see a partial update.
+/// Snapshots are recycled once no reader holds them, so steady state publishing
+/// does not allocate. There are as many buffers as snapshots alive at once, usually two.
+class dtTreePublisher
+{
+public:
+
+	dtTreePublisher();
+	~dtTreePublisher();
+
+	dtTreePublisher(const dtTreePublisher&) = delete;
+	dtTreePublisher& operator=(const dtTreePublisher&) = delete;
+
+	/// Writer only. Copy the tree into a free buffer and make it the current snapshot.
+	/// Returns false and keeps the old snapshot if readers hold all dt_maxSnapshotBuffers.
+	bool Publish(const dtTree& tree);
+
+	/// Any thread. Get the current snapshot, null before the first Publish. Proxy ids
+	/// of the source tree at the time of publishing are valid in the snapshot.
+	/// A non-null snapshot must be passed to Release when the reader is done with it.
+	const dtTree* Acquire() const;
+
+	/// Any thread. Give back a snapshot from Acquire.
+	void Release(const dtTree* snapshot) const;
+
+	/// Writer only. The number of snapshot buffers allocated so far.
+	int GetBufferCount() const;
+
+private:
+
+	struct alignas(64) Buffer
+	{
+		dtTree* tree;
+		mutable std::atomic<int> readerCount;
+	};
+
+	Buffer m_buffers[dt_maxSnapshotBuffers];
+	int m_bufferCount;
+	std::atomic<int> m_current;
+};
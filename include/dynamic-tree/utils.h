@@ -11,10 +11,19 @@
 
 #pragma once
 
+#include <assert.h>
+#include <float.h>
 #include <math.h>
 #include <memory.h>
+#include <stdlib.h>
 #include <immintrin.h>
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
 static const float dtPi = 3.141592654f;
 
 inline int dtMin(int a, int b)
@@ -184,6 +193,9 @@ inline dtVec dtMax(const dtVec& a, const dtVec& b)
 	return _mm_max_ps(a, b);
 }
 
+// GCC and Clang provide these operators natively for vector types.
+#if defined(_MSC_VER)
+
 inline dtVec operator + (const dtVec& a, const dtVec& b)
 {
 	return _mm_add_ps(a, b);
@@ -222,12 +234,14 @@ inline dtVec operator - (const dtVec& a)
 	return _mm_sub_ps(_mm_setzero_ps(), a);
 }
 
+#endif
+
 inline dtVec dtAbs(const dtVec& a)
 {
 	return _mm_max_ps(a, -a);
 }
 
-inline bool operator == (const dtVec& a, const dtVec& b)
+inline bool dtIsEqual(const dtVec& a, const dtVec& b)
 {
 	dtVec t = _mm_cmpeq_ps(a, b);
 	return _mm_movemask_ps(t) == 0xF;
@@ -372,6 +386,164 @@ inline dtVec dtExtent(const dtAABB& a)
 	return dtSplat(0.5f) * (a.upperBound - a.lowerBound);
 }
 
+// Does a contain b?
+inline bool dtContains(const dtAABB& a, const dtAABB& b)
+{
+	dtVec d1 = _mm_cmpgt_ps(a.lowerBound, b.lowerBound);
+	dtVec d2 = _mm_cmpgt_ps(b.upperBound, a.upperBound);
+	return (_mm_movemask_ps(_mm_or_ps(d1, d2)) & 0x7) == 0;
+}
+
+inline bool dtTestOverlap(const dtAABB& a, const dtAABB& b)
+{
+	// Separated if either box starts beyond the end of the other on any axis.
+	dtVec d1 = _mm_cmpgt_ps(a.lowerBound, b.upperBound);
+	dtVec d2 = _mm_cmpgt_ps(b.lowerBound, a.upperBound);
+	return (_mm_movemask_ps(_mm_or_ps(d1, d2)) & 0x7) == 0;
+}
+
+/// A plane with an outward normal. Points with dot(normal, p) <= offset are inside.
+struct dtPlane
+{
+	dtVec normal;
+	float offset;
+};
+
+// Classify an AABB against a plane. Returns 1 if the box is fully outside, -1 if it
+// is fully inside and 0 if the plane cuts the box.
+inline int dtClassifyAABB(const dtAABB& a, const dtPlane& plane)
+{
+	dtVec center = dtSplat(0.5f) * (a.lowerBound + a.upperBound);
+	dtVec extent = dtSplat(0.5f) * (a.upperBound - a.lowerBound);
+	float distance = dtGetX(dtDot3(plane.normal, center)) - plane.offset;
+	float radius = dtGetX(dtDot3(dtAbs(plane.normal), extent));
+
+	if (distance > radius)
+	{
+		return 1;
+	}
+
+	return distance <= -radius ? -1 : 0;
+}
+
+// Squared distance from a point to the closest point of an AABB. Zero inside the box.
+inline float dtDistanceSquared(const dtAABB& a, const dtVec& point)
+{
+	dtVec d = _mm_max_ps(_mm_max_ps(_mm_sub_ps(a.lowerBound, point), _mm_sub_ps(point, a.upperBound)), _mm_setzero_ps());
+	return dtGetX(dtDot3(d, d));
+}
+
+// Component-wise reciprocal of a ray direction for use with dtRayCastAABB. Zero components
+// map to FLT_MAX instead of infinity so the slab test never computes 0 * inf.
+inline dtVec dtRayInverse(const dtVec& direction)
+{
+	dtVec zero = _mm_cmpeq_ps(direction, _mm_setzero_ps());
+	dtVec inverse = _mm_div_ps(dtSplat(1.0f), direction);
+	return _mm_or_ps(_mm_andnot_ps(zero, inverse), _mm_and_ps(zero, dtSplat(FLT_MAX)));
+}
+
+// Slab test of the ray origin + t * direction against an AABB for t in [0, maxFraction].
+// Returns the fraction where the ray enters the box or FLT_MAX if the ray misses.
+inline float dtRayCastAABB(const dtAABB& a, const dtVec& origin, const dtVec& invDirection, float maxFraction)
+{
+	dtVec t1 = _mm_mul_ps(_mm_sub_ps(a.lowerBound, origin), invDirection);
+	dtVec t2 = _mm_mul_ps(_mm_sub_ps(a.upperBound, origin), invDirection);
+
+	// Replicate x into w so the unused lane does not take part in the reduction.
+	dtVec tmin = _mm_min_ps(t1, t2);
+	dtVec tmax = _mm_max_ps(t1, t2);
+	tmin = _mm_shuffle_ps(tmin, tmin, _MM_SHUFFLE(0, 2, 1, 0));
+	tmax = _mm_shuffle_ps(tmax, tmax, _MM_SHUFFLE(0, 2, 1, 0));
+
+	tmin = _mm_max_ps(tmin, _mm_shuffle_ps(tmin, tmin, _MM_SHUFFLE(2, 3, 0, 1)));
+	tmin = _mm_max_ps(tmin, _mm_shuffle_ps(tmin, tmin, _MM_SHUFFLE(1, 0, 3, 2)));
+	tmax = _mm_min_ps(tmax, _mm_shuffle_ps(tmax, tmax, _MM_SHUFFLE(2, 3, 0, 1)));
+	tmax = _mm_min_ps(tmax, _mm_shuffle_ps(tmax, tmax, _MM_SHUFFLE(1, 0, 3, 2)));
+
+	float enter = dtMax(dtGetX(tmin), 0.0f);
+	float exit = dtMin(dtGetX(tmax), maxFraction);
+	return enter <= exit ? enter : FLT_MAX;
+}
+
+// Marks a function that uses AVX2 intrinsics. Only call such functions after
+// dtHasAVX2 returned true. MSVC accepts the intrinsics without a target attribute.
+#if defined(_MSC_VER)
+#define DT_TARGET_AVX2
+#else
+#define DT_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+/// Check CPUID and the operating system for AVX2 support. The result is cached.
+bool dtHasAVX2();
+
+/// This is a growable LIFO stack with an initial capacity of N.
+/// If the stack size exceeds the initial capacity, the heap is used
+/// to increase the size of the stack.
+template <typename T, int N>
+class dtGrowableStack
+{
+public:
+
+	dtGrowableStack()
+	{
+		m_stack = m_array;
+		m_count = 0;
+		m_capacity = N;
+	}
+
+	~dtGrowableStack()
+	{
+		if (m_stack != m_array)
+		{
+			free(m_stack);
+			m_stack = nullptr;
+		}
+	}
+
+	void Push(const T& element)
+	{
+		if (m_count == m_capacity)
+		{
+			T* old = m_stack;
+			m_capacity *= 2;
+			m_stack = (T*)malloc(m_capacity * sizeof(T));
+			memcpy(m_stack, old, m_count * sizeof(T));
+			if (old != m_array)
+			{
+				free(old);
+			}
+		}
+
+		m_stack[m_count] = element;
+		++m_count;
+	}
+
+	T Pop()
+	{
+		assert(m_count > 0);
+		--m_count;
+		return m_stack[m_count];
+	}
+
+	int GetCount() const
+	{
+		return m_count;
+	}
+
+	/// The elements in push order. This may move when the stack grows.
+	T* GetData()
+	{
+		return m_stack;
+	}
+
+private:
+
+	T* m_stack;
+	T m_array[N];
+	int m_count;
+	int m_capacity;
+};
+
 struct dtFree
 {
 	void operator()(void* x) { free(x); }
@@ -395,5 +567,73 @@ private:
 #if defined(_WIN32)
 	double m_start;
 	static double s_invFrequency;
+#else
+	unsigned long long m_start;
 #endif
 };
+
+/// Get a monotonic time stamp in nanoseconds.
+unsigned long long dtGetNanoseconds();
+
+/// Read the processor time stamp counter. This is cheaper than the clock and suited
+/// to timing short functions, but the tick rate depends on the processor.
+inline unsigned long long dtGetCycles()
+{
+	return __rdtsc();
+}
+
+/// Timing statistics of a code path, accumulated by dtScopedTimer.
+struct dtTimerStat
+{
+	dtTimerStat()
+	{
+		useCycles = false;
+		Reset();
+	}
+
+	void Reset()
+	{
+		total = 0;
+		max = 0;
+		count = 0;
+	}
+
+	/// Average nanoseconds or cycles per call.
+	double GetAverage() const
+	{
+		return count > 0 ? double(total) / double(count) : 0.0;
+	}
+
+	unsigned long long total;
+	unsigned long long max;
+	unsigned long long count;
+
+	/// Count processor cycles instead of nanoseconds.
+	bool useCycles;
+};
+
+/// Adds the time spent in a scope to a dtTimerStat.
+class dtScopedTimer
+{
+public:
+
+	explicit dtScopedTimer(dtTimerStat& stat)
+		: m_stat(stat)
+	{
+		m_start = stat.useCycles ? dtGetCycles() : dtGetNanoseconds();
+	}
+
+	~dtScopedTimer()
+	{
+		unsigned long long end = m_stat.useCycles ? dtGetCycles() : dtGetNanoseconds();
+		unsigned long long duration = end - m_start;
+		m_stat.total += duration;
+		m_stat.max = duration > m_stat.max ? duration : m_stat.max;
+		m_stat.count += 1;
+	}
+
+private:
+
+	dtTimerStat& m_stat;
+	unsigned long long m_start;
+};
@@ -0,0 +1,438 @@
+/*
+* Copyright (c) 2019 Erin Catto http://www.box2d.org
+*
+* Permission to use, copy, modify, distribute and sell this software
+* and its documentation for any purpose is hereby granted without fee,
+* provided that the above copyright notice appear in all copies.
+* Erin Catto makes no representations about the suitability
+* of this software for any purpose.
+* It is provided "as is" without express or implied warranty.
+*/
+
+#pragma once
+
+#include "dynamic-tree/tree.h"
+
+#define dt_wideCount 4
+#define dt_wideCount8 8
+
+/// A node of the 4-wide tree. The child bounds are stored as SIMD lanes so
+/// all four children are tested at once.
+struct dtWideNode
+{
+	dtVec lowerX, lowerY, lowerZ;
+	dtVec upperX, upperY, upperZ;
+
+	/// Wide node index for internal children, proxy id for leaves and
+	/// dt_nullNode for empty lanes. Empty lanes have inverted bounds.
+	int children[dt_wideCount];
+
+	/// Bit i is set if child i is a leaf.
+	int leafMask;
+};
+
+/// A node of the 8-wide tree used with AVX2. The node takes four cache lines and
+/// must be 32 byte aligned for the 256-bit loads.
+struct alignas(32) dtWideNode8
+{
+	float lowerX[dt_wideCount8], lowerY[dt_wideCount8], lowerZ[dt_wideCount8];
+	float upperX[dt_wideCount8], upperY[dt_wideCount8], upperZ[dt_wideCount8];
+
+	/// Same encoding as dtWideNode.
+	int children[dt_wideCount8];
+	int leafMask;
+};
+
+/// Gather the children of a binary node for a wide node. The child with the largest
+/// area is expanded until there are width children or only leaves remain. For
+/// balanced trees this collapses two levels into a 4-wide node and three levels into
+/// an 8-wide node.
+/// @return the number of children written.
+int dtCollapseNode(const dtTree& tree, int nodeIndex, int* children, int width);
+
+/// A query only wide BVH produced from a dtTree. Each node holds up to four child
+/// boxes in SSE lanes, so ray and overlap queries fetch far fewer nodes than binary
+/// traversal. Build is linear in the node count. Refit only copies bounds and may be
+/// used as long as the tree topology did not change since the last build.
+/// On processors with AVX2 the tree is built with 8-wide nodes and traversed with
+/// 256-bit slab tests, otherwise it falls back to 4-wide SSE nodes.
+struct dtWideTree
+{
+	dtWideTree();
+	~dtWideTree();
+
+	/// Collapse the tree into wide nodes. This reuses the node storage.
+	void Build(const dtTree& tree);
+
+	/// Update the bounds from the tree. The topology must match the last build.
+	void Refit(const dtTree& tree);
+
+	void Clear();
+
+	int GetNodeCount() const;
+
+	/// Same as dtTree::Query. The callback receives proxy ids of the source tree.
+	template <typename T>
+	void Query(const dtAABB& aabb, T* callback) const;
+
+	/// Same as dtTree::RayCast. The callback receives proxy ids of the source tree.
+	template <typename T>
+	void RayCast(const dtVec& origin, const dtVec& direction, float maxFraction, T* callback) const;
+
+	template <typename T>
+	DT_TARGET_AVX2 void QueryAVX2(const dtAABB& aabb, T* callback) const;
+
+	template <typename T>
+	DT_TARGET_AVX2 void RayCastAVX2(const dtVec& origin, const dtVec& direction, float maxFraction, T* callback) const;
+
+	/// Build 8-wide nodes if the processor supports AVX2. This is set by the
+	/// constructor and may be cleared to force the SSE path. Takes effect on Build.
+	bool m_useAVX2;
+
+	/// Node width of the last build, 4 or 8.
+	int m_width;
+
+	dtWideNode* m_nodes;
+	dtWideNode8* m_nodes8;
+
+	// Source tree node of every lane. Used by Refit.
+	int* m_sources;
+
+	int m_nodeCount;
+	int m_nodeCapacity;
+	int m_nodeCapacity8;
+	int m_sourceCapacity;
+};
+
+template <typename T>
+inline void dtWideTree::Query(const dtAABB& aabb, T* callback) const
+{
+	if (m_nodeCount == 0)
+	{
+		return;
+	}
+
+	if (m_width == dt_wideCount8)
+	{
+		QueryAVX2(aabb, callback);
+		return;
+	}
+
+	dtVec lowerX = _mm_shuffle_ps(aabb.lowerBound, aabb.lowerBound, _MM_SHUFFLE(0, 0, 0, 0));
+	dtVec lowerY = _mm_shuffle_ps(aabb.lowerBound, aabb.lowerBound, _MM_SHUFFLE(1, 1, 1, 1));
+	dtVec lowerZ = _mm_shuffle_ps(aabb.lowerBound, aabb.lowerBound, _MM_SHUFFLE(2, 2, 2, 2));
+	dtVec upperX = _mm_shuffle_ps(aabb.upperBound, aabb.upperBound, _MM_SHUFFLE(0, 0, 0, 0));
+	dtVec upperY = _mm_shuffle_ps(aabb.upperBound, aabb.upperBound, _MM_SHUFFLE(1, 1, 1, 1));
+	dtVec upperZ = _mm_shuffle_ps(aabb.upperBound, aabb.upperBound, _MM_SHUFFLE(2, 2, 2, 2));
+
+	dtGrowableStack<int, 256> stack;
+	stack.Push(0);
+
+	while (stack.GetCount() > 0)
+	{
+		const dtWideNode& node = m_nodes[stack.Pop()];
+
+		dtVec x = _mm_and_ps(_mm_cmple_ps(node.lowerX, upperX), _mm_cmpge_ps(node.upperX, lowerX));
+		dtVec y = _mm_and_ps(_mm_cmple_ps(node.lowerY, upperY), _mm_cmpge_ps(node.upperY, lowerY));
+		dtVec z = _mm_and_ps(_mm_cmple_ps(node.lowerZ, upperZ), _mm_cmpge_ps(node.upperZ, lowerZ));
+		int mask = _mm_movemask_ps(_mm_and_ps(_mm_and_ps(x, y), z));
+
+		for (int i = 0; i < dt_wideCount; ++i)
+		{
+			if ((mask & (1 << i)) == 0 || node.children[i] == dt_nullNode)
+			{
+				continue;
+			}
+
+			if (node.leafMask & (1 << i))
+			{
+				bool proceed = callback->QueryCallback(node.children[i]);
+				if (proceed == false)
+				{
+					return;
+				}
+			}
+			else
+			{
+				stack.Push(node.children[i]);
+			}
+		}
+	}
+}
+
+template <typename T>
+inline void dtWideTree::RayCast(const dtVec& origin, const dtVec& direction, float maxFraction, T* callback) const
+{
+	if (m_nodeCount == 0)
+	{
+		return;
+	}
+
+	if (m_width == dt_wideCount8)
+	{
+		RayCastAVX2(origin, direction, maxFraction, callback);
+		return;
+	}
+
+	dtVec invDirection = dtRayInverse(direction);
+
+	dtVec originX = _mm_shuffle_ps(origin, origin, _MM_SHUFFLE(0, 0, 0, 0));
+	dtVec originY = _mm_shuffle_ps(origin, origin, _MM_SHUFFLE(1, 1, 1, 1));
+	dtVec originZ = _mm_shuffle_ps(origin, origin, _MM_SHUFFLE(2, 2, 2, 2));
+	dtVec invX = _mm_shuffle_ps(invDirection, invDirection, _MM_SHUFFLE(0, 0, 0, 0));
+	dtVec invY = _mm_shuffle_ps(invDirection, invDirection, _MM_SHUFFLE(1, 1, 1, 1));
+	dtVec invZ = _mm_shuffle_ps(invDirection, invDirection, _MM_SHUFFLE(2, 2, 2, 2));
+
+	// The root is not tested on its own, its children are tested with the first node.
+	dtRayCastNode entry;
+	entry.index = 0;
+	entry.fraction = 0.0f;
+
+	dtGrowableStack<dtRayCastNode, 256> stack;
+	stack.Push(entry);
+
+	while (stack.GetCount() > 0)
+	{
+		entry = stack.Pop();
+		if (entry.fraction > maxFraction)
+		{
+			// The ray was clipped after this node was pushed.
+			continue;
+		}
+
+		const dtWideNode& node = m_nodes[entry.index];
+
+		dtVec x1 = _mm_mul_ps(_mm_sub_ps(node.lowerX, originX), invX);
+		dtVec x2 = _mm_mul_ps(_mm_sub_ps(node.upperX, originX), invX);
+		dtVec y1 = _mm_mul_ps(_mm_sub_ps(node.lowerY, originY), invY);
+		dtVec y2 = _mm_mul_ps(_mm_sub_ps(node.upperY, originY), invY);
+		dtVec z1 = _mm_mul_ps(_mm_sub_ps(node.lowerZ, originZ), invZ);
+		dtVec z2 = _mm_mul_ps(_mm_sub_ps(node.upperZ, originZ), invZ);
+
+		dtVec tmin = _mm_max_ps(_mm_max_ps(_mm_min_ps(x1, x2), _mm_min_ps(y1, y2)), _mm_max_ps(_mm_min_ps(z1, z2), _mm_setzero_ps()));
+		dtVec tmax = _mm_min_ps(_mm_min_ps(_mm_max_ps(x1, x2), _mm_max_ps(y1, y2)), _mm_min_ps(_mm_max_ps(z1, z2), _mm_set1_ps(maxFraction)));
+		int mask = _mm_movemask_ps(_mm_cmple_ps(tmin, tmax));
+
+		// Sort the hit children by entry fraction.
+		dtRayCastNode hits[dt_wideCount];
+		int hitCount = 0;
+
+		alignas(16) float fractions[dt_wideCount];
+		_mm_store_ps(fractions, tmin);
+
+		for (int i = 0; i < dt_wideCount; ++i)
+		{
+			if ((mask & (1 << i)) == 0 || node.children[i] == dt_nullNode)
+			{
+				continue;
+			}
+
+			int j = hitCount++;
+			while (j > 0 && hits[j - 1].fraction > fractions[i])
+			{
+				hits[j] = hits[j - 1];
+				--j;
+			}
+
+			// Lane index is stored for now, resolved below.
+			hits[j].index = i;
+			hits[j].fraction = fractions[i];
+		}
+
+		// Leaves are reported near to far so they clip the ray right away.
+		int nodeCount = 0;
+		for (int i = 0; i < hitCount; ++i)
+		{
+			if (hits[i].fraction > maxFraction)
+			{
+				break;
+			}
+
+			int lane = hits[i].index;
+			int child = node.children[lane];
+
+			if ((node.leafMask & (1 << lane)) == 0)
+			{
+				hits[nodeCount].index = child;
+				hits[nodeCount].fraction = hits[i].fraction;
+				++nodeCount;
+				continue;
+			}
+
+			float value = callback->RayCastCallback(origin, direction, maxFraction, child);
+
+			if (value == 0.0f)
+			{
+				// The client has terminated the ray cast.
+				return;
+			}
+
+			if (value > 0.0f)
+			{
+				// Clip the ray.
+				maxFraction = dtMin(value, maxFraction);
+			}
+		}
+
+		// Push far to near so the nearest node is popped first.
+		for (int i = nodeCount - 1; i >= 0; --i)
+		{
+			stack.Push(hits[i]);
+		}
+	}
+}
+
+template <typename T>
+DT_TARGET_AVX2 inline void dtWideTree::QueryAVX2(const dtAABB& aabb, T* callback) const
+{
+	__m256 lowerX = _mm256_set1_ps(dtGetX(aabb.lowerBound));
+	__m256 lowerY = _mm256_set1_ps(dtGetY(aabb.lowerBound));
+	__m256 lowerZ = _mm256_set1_ps(dtGetZ(aabb.lowerBound));
+	__m256 upperX = _mm256_set1_ps(dtGetX(aabb.upperBound));
+	__m256 upperY = _mm256_set1_ps(dtGetY(aabb.upperBound));
+	__m256 upperZ = _mm256_set1_ps(dtGetZ(aabb.upperBound));
+
+	dtGrowableStack<int, 256> stack;
+	stack.Push(0);
+
+	while (stack.GetCount() > 0)
+	{
+		const dtWideNode8& node = m_nodes8[stack.Pop()];
+
+		__m256 x = _mm256_and_ps(_mm256_cmp_ps(_mm256_load_ps(node.lowerX), upperX, _CMP_LE_OQ), _mm256_cmp_ps(_mm256_load_ps(node.upperX), lowerX, _CMP_GE_OQ));
+		__m256 y = _mm256_and_ps(_mm256_cmp_ps(_mm256_load_ps(node.lowerY), upperY, _CMP_LE_OQ), _mm256_cmp_ps(_mm256_load_ps(node.upperY), lowerY, _CMP_GE_OQ));
+		__m256 z = _mm256_and_ps(_mm256_cmp_ps(_mm256_load_ps(node.lowerZ), upperZ, _CMP_LE_OQ), _mm256_cmp_ps(_mm256_load_ps(node.upperZ), lowerZ, _CMP_GE_OQ));
+		int mask = _mm256_movemask_ps(_mm256_and_ps(_mm256_and_ps(x, y), z));
+
+		for (int i = 0; i < dt_wideCount8; ++i)
+		{
+			if ((mask & (1 << i)) == 0 || node.children[i] == dt_nullNode)
+			{
+				continue;
+			}
+
+			if (node.leafMask & (1 << i))
+			{
+				bool proceed = callback->QueryCallback(node.children[i]);
+				if (proceed == false)
+				{
+					return;
+				}
+			}
+			else
+			{
+				stack.Push(node.children[i]);
+			}
+		}
+	}
+}
+
+template <typename T>
+DT_TARGET_AVX2 inline void dtWideTree::RayCastAVX2(const dtVec& origin, const dtVec& direction, float maxFraction, T* callback) const
+{
+	dtVec invDirection = dtRayInverse(direction);
+
+	__m256 originX = _mm256_set1_ps(dtGetX(origin));
+	__m256 originY = _mm256_set1_ps(dtGetY(origin));
+	__m256 originZ = _mm256_set1_ps(dtGetZ(origin));
+	__m256 invX = _mm256_set1_ps(dtGetX(invDirection));
+	__m256 invY = _mm256_set1_ps(dtGetY(invDirection));
+	__m256 invZ = _mm256_set1_ps(dtGetZ(invDirection));
+
+	dtRayCastNode entry;
+	entry.index = 0;
+	entry.fraction = 0.0f;
+
+	dtGrowableStack<dtRayCastNode, 256> stack;
+	stack.Push(entry);
+
+	while (stack.GetCount() > 0)
+	{
+		entry = stack.Pop();
+		if (entry.fraction > maxFraction)
+		{
+			// The ray was clipped after this node was pushed.
+			continue;
+		}
+
+		const dtWideNode8& node = m_nodes8[entry.index];
+
+		__m256 x1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.lowerX), originX), invX);
+		__m256 x2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.upperX), originX), invX);
+		__m256 y1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.lowerY), originY), invY);
+		__m256 y2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.upperY), originY), invY);
+		__m256 z1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.lowerZ), originZ), invZ);
+		__m256 z2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.upperZ), originZ), invZ);
+
+		__m256 tmin = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(x1, x2), _mm256_min_ps(y1, y2)), _mm256_max_ps(_mm256_min_ps(z1, z2), _mm256_setzero_ps()));
+		__m256 tmax = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(x1, x2), _mm256_max_ps(y1, y2)), _mm256_min_ps(_mm256_max_ps(z1, z2), _mm256_set1_ps(maxFraction)));
+		int mask = _mm256_movemask_ps(_mm256_cmp_ps(tmin, tmax, _CMP_LE_OQ));
+
+		// Sort the hit children by entry fraction.
+		dtRayCastNode hits[dt_wideCount8];
+		int hitCount = 0;
+
+		alignas(32) float fractions[dt_wideCount8];
+		_mm256_store_ps(fractions, tmin);
+
+		for (int i = 0; i < dt_wideCount8; ++i)
+		{
+			if ((mask & (1 << i)) == 0 || node.children[i] == dt_nullNode)
+			{
+				continue;
+			}
+
+			int j = hitCount++;
+			while (j > 0 && hits[j - 1].fraction > fractions[i])
+			{
+				hits[j] = hits[j - 1];
+				--j;
+			}
+
+			// Lane index is stored for now, resolved below.
+			hits[j].index = i;
+			hits[j].fraction = fractions[i];
+		}
+
+		// Leaves are reported near to far so they clip the ray right away.
+		int nodeCount = 0;
+		for (int i = 0; i < hitCount; ++i)
+		{
+			if (hits[i].fraction > maxFraction)
+			{
+				break;
+			}
+
+			int lane = hits[i].index;
+			int child = node.children[lane];
+
+			if ((node.leafMask & (1 << lane)) == 0)
+			{
+				hits[nodeCount].index = child;
+				hits[nodeCount].fraction = hits[i].fraction;
+				++nodeCount;
+				continue;
+			}
+
+			float value = callback->RayCastCallback(origin, direction, maxFraction, child);
+
+			if (value == 0.0f)
+			{
+				// The client has terminated the ray cast.
+				return;
+			}
+
+			if (value > 0.0f)
+			{
+				// Clip the ray.
+				maxFraction = dtMin(value, maxFraction);
+			}
+		}
+
+		// Push far to near so the nearest node is popped first.
+		for (int i = nodeCount - 1; i >= 0; --i)
+		{
+			stack.Push(hits[i]);
+		}
+	}
+}
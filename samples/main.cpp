@@ -253,6 +253,11 @@ static void DrawUI()
 				g_test->RebuildBottomUp();
 			}
 
+			if (ImGui::Button("PLOC"))
+			{
+				g_test->RebuildPLOC();
+			}
+
 			if (ImGui::Button("Top Down SAH"))
 			{
 				g_test->RebuildTopDownSAH();
@@ -22,6 +22,9 @@ void Test::Create(dtInsertionHeuristic heuristic)
 
 	m_tree.m_heuristic = heuristic;
 
+	// Keep the boxes tight so the tree metrics compare with the top down builders.
+	m_tree.m_aabbMargin = 0.0f;
+
 	dtTimer timer;
 	for (int i = 0; i < m_count; ++i)
 	{
@@ -143,6 +146,21 @@ void Test::RebuildBottomUp()
 	m_base = 0;
 }
 
+void Test::RebuildPLOC()
+{
+	dtTimer timer;
+	m_tree.RebuildPLOC();
+	m_buildTime = timer.GetMilliseconds();
+
+	m_proxyCount = m_tree.GetProxyCount();
+	m_nodeCount = m_tree.m_nodeCount;
+	m_treeHeight = m_tree.GetHeight();
+	m_heapCount = m_tree.m_maxHeapCount;
+	m_treeArea = m_tree.GetAreaRatio();
+
+	m_base = 0;
+}
+
 Test* g_tests[s_maxTests] = { nullptr };
 int g_testCount = 0;
 
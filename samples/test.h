@@ -29,6 +29,7 @@ struct Test
 	void RebuildTopDownSAH();
 	void RebuildTopDownMedian();
 	void RebuildBottomUp();
+	void RebuildPLOC();
 
 	dtAABB* m_boxes;
 	int* m_proxies;
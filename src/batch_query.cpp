@@ -0,0 +1,108 @@
+/*
+* Copyright (c) 2019 Erin Catto http://www.box2d.org
+*
+* Permission to use, copy, modify, distribute and sell this software
+* and its documentation for any purpose is hereby granted without fee,
+* provided that the above copyright notice appear in all copies.
+* Erin Catto makes no representations about the suitability
+* of this software for any purpose.
+* It is provided "as is" without express or implied warranty.
+*/
+
+#include "dynamic-tree/batch_query.h"
+#include <assert.h>
+#include <string.h>
+
+dtBatchQuery::dtBatchQuery()
+{
+	m_queryCount = 0;
+}
+
+dtBatchQuery::~dtBatchQuery()
+{
+	for (ThreadBuffer& buffer : m_threadBuffers)
+	{
+		for (int* chunk : buffer.chunks)
+		{
+			free(chunk);
+		}
+	}
+}
+
+void dtBatchQuery::Begin(int count, dtTaskScheduler& scheduler)
+{
+	m_queryCount = count;
+
+	if (int(m_threadBuffers.size()) < scheduler.GetThreadCount())
+	{
+		m_threadBuffers.resize(scheduler.GetThreadCount());
+	}
+
+	for (ThreadBuffer& buffer : m_threadBuffers)
+	{
+		buffer.hitCount = 0;
+	}
+
+	m_threads.resize(count);
+	m_starts.resize(count);
+
+	// Holds the hit counts shifted by one until Finish turns them into offsets.
+	m_offsets.resize(count + 1);
+	m_offsets[0] = 0;
+}
+
+void dtBatchQuery::Finish(dtTaskScheduler& scheduler)
+{
+	int count = m_queryCount;
+	for (int i = 0; i < count; ++i)
+	{
+		m_offsets[i + 1] += m_offsets[i];
+	}
+
+	m_hits.resize(m_offsets[count]);
+
+	// The ranges of the queries in the thread buffers are disjoint, so they are
+	// gathered in parallel.
+	scheduler.ParallelFor(count, 4 * dt_batchQueryRange, [this](int begin, int end)
+	{
+		for (int i = begin; i < end; ++i)
+		{
+			// The hits of a query may straddle chunks.
+			const ThreadBuffer& buffer = m_threadBuffers[m_threads[i]];
+			int* target = m_hits.data() + m_offsets[i];
+			int position = m_starts[i];
+			int remaining = m_offsets[i + 1] - m_offsets[i];
+			while (remaining > 0)
+			{
+				int offset = position % dt_batchHitChunkSize;
+				int copyCount = dtMin(remaining, dt_batchHitChunkSize - offset);
+				memcpy(target, buffer.chunks[position / dt_batchHitChunkSize] + offset, copyCount * sizeof(int));
+				target += copyCount;
+				position += copyCount;
+				remaining -= copyCount;
+			}
+		}
+	});
+}
+
+int dtBatchQuery::GetQueryCount() const
+{
+	return m_queryCount;
+}
+
+int dtBatchQuery::GetHitCount(int query) const
+{
+	assert(0 <= query && query < m_queryCount);
+	return m_offsets[query + 1] - m_offsets[query];
+}
+
+const int* dtBatchQuery::GetHits(int query) const
+{
+	assert(0 <= query && query < m_queryCount);
+	return m_hits.data() + m_offsets[query];
+}
+
+int dtBatchQuery::GetTotalHitCount() const
+{
+	return m_queryCount > 0 ? m_offsets[m_queryCount] : 0;
+}
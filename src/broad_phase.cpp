@@ -0,0 +1,188 @@
+/*
+* Copyright (c) 2019 Erin Catto http://www.box2d.org
+*
+* Permission to use, copy, modify, distribute and sell this software
+* and its documentation for any purpose is hereby granted without fee,
+* provided that the above copyright notice appear in all copies.
+* Erin Catto makes no representations about the suitability
+* of this software for any purpose.
+* It is provided "as is" without express or implied warranty.
+*/
+
+#include "dynamic-tree/broad_phase.h"
+#include <algorithm>
+#include <assert.h>
+
+dtBroadPhase::dtBroadPhase()
+{
+	m_moveBuffer.reserve(16);
+	m_destroyBuffer.reserve(16);
+	m_pairs.reserve(16);
+	m_oldPairs.reserve(16);
+	m_queryProxyId = dt_nullNode;
+}
+
+int dtBroadPhase::CreateProxy(const dtAABB& aabb, int objectIndex)
+{
+	int proxyId = m_tree.CreateProxy(aabb, objectIndex);
+	BufferMove(proxyId);
+	return proxyId;
+}
+
+void dtBroadPhase::DestroyProxy(int proxyId)
+{
+	UnBufferMove(proxyId);
+	m_tree.DestroyProxy(proxyId);
+
+	// The pairs of this proxy are ended during the next update. The id may be
+	// reused before then, so the flag keeps the old pairs from persisting.
+	if (int(m_flags.size()) <= proxyId)
+	{
+		m_flags.resize(m_tree.m_nodeCapacity, 0);
+	}
+
+	if ((m_flags[proxyId] & e_destroyed) == 0)
+	{
+		m_flags[proxyId] |= e_destroyed;
+		m_destroyBuffer.push_back(proxyId);
+	}
+}
+
+void dtBroadPhase::MoveProxy(int proxyId, const dtAABB& aabb, const dtVec& displacement)
+{
+	bool buffer = m_tree.MoveProxy(proxyId, aabb, displacement);
+	if (buffer)
+	{
+		BufferMove(proxyId);
+	}
+}
+
+const dtAABB& dtBroadPhase::GetAABB(int proxyId) const
+{
+	return m_tree.GetAABB(proxyId);
+}
+
+int dtBroadPhase::GetObjectIndex(int proxyId) const
+{
+	assert(0 <= proxyId && proxyId < m_tree.m_nodeCapacity);
+	return m_tree.m_nodes[proxyId].objectIndex;
+}
+
+int dtBroadPhase::GetProxyCount() const
+{
+	return m_tree.GetProxyCount();
+}
+
+int dtBroadPhase::GetPairCount() const
+{
+	return int(m_pairs.size());
+}
+
+const dtPair* dtBroadPhase::GetPairs() const
+{
+	return m_pairs.data();
+}
+
+void dtBroadPhase::BufferMove(int proxyId)
+{
+	if (int(m_flags.size()) <= proxyId)
+	{
+		m_flags.resize(m_tree.m_nodeCapacity, 0);
+	}
+
+	if (m_flags[proxyId] & e_moved)
+	{
+		// Already buffered
+		return;
+	}
+
+	m_flags[proxyId] |= e_moved;
+	m_moveBuffer.push_back(proxyId);
+}
+
+void dtBroadPhase::UnBufferMove(int proxyId)
+{
+	if (int(m_flags.size()) <= proxyId || (m_flags[proxyId] & e_moved) == 0)
+	{
+		return;
+	}
+
+	m_flags[proxyId] &= ~e_moved;
+
+	int count = int(m_moveBuffer.size());
+	for (int i = 0; i < count; ++i)
+	{
+		if (m_moveBuffer[i] == proxyId)
+		{
+			m_moveBuffer[i] = dt_nullNode;
+		}
+	}
+}
+
+// This is called from dtTree::Query when we are gathering pairs.
+bool dtBroadPhase::QueryCallback(int proxyId)
+{
+	// A proxy cannot form a pair with itself.
+	if (proxyId == m_queryProxyId)
+	{
+		return true;
+	}
+
+	// Both proxies are moving. Avoid duplicate pairs.
+	if ((m_flags[proxyId] & e_moved) && proxyId > m_queryProxyId)
+	{
+		return true;
+	}
+
+	dtPair pair;
+	pair.proxyIdA = dtMin(proxyId, m_queryProxyId);
+	pair.proxyIdB = dtMax(proxyId, m_queryProxyId);
+	m_pairs.push_back(pair);
+
+	// Keep going to find all pairs.
+	return true;
+}
+
+void dtBroadPhase::FindPairs()
+{
+	assert(m_oldPairs.empty());
+	m_oldPairs.swap(m_pairs);
+
+	if (int(m_flags.size()) < m_tree.m_nodeCapacity)
+	{
+		m_flags.resize(m_tree.m_nodeCapacity, 0);
+	}
+
+	// Pairs of proxies that neither moved nor were destroyed still overlap. These
+	// stay sorted and never need a tree query.
+	int oldCount = int(m_oldPairs.size());
+	for (int i = 0; i < oldCount; ++i)
+	{
+		const dtPair& pair = m_oldPairs[i];
+		if ((m_flags[pair.proxyIdA] | m_flags[pair.proxyIdB]) == 0)
+		{
+			m_pairs.push_back(pair);
+		}
+	}
+
+	int persistCount = int(m_pairs.size());
+
+	// Query the tree with the moved proxies. Every pair found here has at least one
+	// moved proxy, so it cannot duplicate a persisting pair.
+	int moveCount = int(m_moveBuffer.size());
+	for (int i = 0; i < moveCount; ++i)
+	{
+		m_queryProxyId = m_moveBuffer[i];
+		if (m_queryProxyId == dt_nullNode)
+		{
+			continue;
+		}
+
+		m_tree.Query(m_tree.GetAABB(m_queryProxyId), this);
+	}
+
+	m_queryProxyId = dt_nullNode;
+
+	std::sort(m_pairs.begin() + persistCount, m_pairs.end());
+	std::inplace_merge(m_pairs.begin(), m_pairs.begin() + persistCount, m_pairs.end());
+}
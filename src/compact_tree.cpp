@@ -0,0 +1,100 @@
+/*
+* Copyright (c) 2019 Erin Catto http://www.box2d.org
+*
+* Permission to use, copy, modify, distribute and sell this software
+* and its documentation for any purpose is hereby granted without fee,
+* provided that the above copyright notice appear in all copies.
+* Erin Catto makes no representations about the suitability
+* of this software for any purpose.
+* It is provided "as is" without express or implied warranty.
+*/
+
+#include "dynamic-tree/compact_tree.h"
+#include <assert.h>
+#include <stdint.h>
+
+static_assert(sizeof(dtCompactNode) == 32, "compact node should be half a cache line");
+
+dtCompactTree::dtCompactTree()
+{
+	m_nodes = nullptr;
+	m_nodeCount = 0;
+	m_nodeCapacity = 0;
+}
+
+dtCompactTree::~dtCompactTree()
+{
+	free(m_nodes);
+}
+
+void dtCompactTree::Clear()
+{
+	m_nodeCount = 0;
+}
+
+int dtCompactTree::GetNodeCount() const
+{
+	return m_nodeCount;
+}
+
+// Copy the tree in depth first order. The second child is linked once the
+// subtree of the first child has been written.
+void dtCompactTree::Build(const dtTree& tree)
+{
+	m_nodeCount = 0;
+
+	if (tree.m_root == dt_nullNode)
+	{
+		return;
+	}
+
+	if (m_nodeCapacity < tree.m_nodeCount)
+	{
+		free(m_nodes);
+		m_nodeCapacity = tree.m_nodeCount;
+		m_nodes = (dtCompactNode*)malloc(m_nodeCapacity * sizeof(dtCompactNode));
+
+		// The bounds are loaded with aligned loads.
+		assert((uintptr_t(m_nodes) & 15) == 0);
+	}
+
+	struct StackEntry
+	{
+		int treeIndex;
+		int parentIndex;
+	};
+
+	dtGrowableStack<StackEntry, 256> stack;
+	stack.Push({ tree.m_root, dt_nullNode });
+
+	while (stack.GetCount() > 0)
+	{
+		StackEntry entry = stack.Pop();
+		const dtNode& source = tree.m_nodes[entry.treeIndex];
+
+		assert(m_nodeCount < m_nodeCapacity);
+		int index = m_nodeCount++;
+
+		if (entry.parentIndex != dt_nullNode)
+		{
+			m_nodes[entry.parentIndex].child2 = index;
+		}
+
+		dtCompactNode& node = m_nodes[index];
+		_mm_storeu_ps(node.lowerBound, source.aabb.lowerBound);
+		_mm_storeu_ps(node.upperBound, source.aabb.upperBound);
+
+		// The stores above wrote the w lanes, so set the links after.
+		node.child2 = dt_nullNode;
+		node.proxyId = source.isLeaf ? entry.treeIndex : dt_nullNode;
+
+		if (source.isLeaf == false)
+		{
+			// The first child is written next, the second child links back to this node.
+			stack.Push({ source.child2, index });
+			stack.Push({ source.child1, dt_nullNode });
+		}
+	}
+
+	assert(m_nodeCount <= tree.m_nodeCount);
+}
@@ -0,0 +1,251 @@
+/*
+* Copyright (c) 2019 Erin Catto http://www.box2d.org
+*
+* Permission to use, copy, modify, distribute and sell this software
+* and its documentation for any purpose is hereby granted without fee,
+* provided that the above copyright notice appear in all copies.
+* Erin Catto makes no representations about the suitability
+* of this software for any purpose.
+* It is provided "as is" without express or implied warranty.
+*/
+
+#include "dynamic-tree/task_scheduler.h"
+#include <assert.h>
+
+// The scheduler and queue index of the current thread. Threads outside the
+// scheduler use queue 0.
+struct dtThreadContext
+{
+	const dtTaskScheduler* scheduler;
+	int index;
+};
+
+static thread_local dtThreadContext t_context = { nullptr, 0 };
+
+dtTaskScheduler::dtTaskScheduler(int workerCount)
+{
+	static_assert((dt_maxQueuedTasks & (dt_maxQueuedTasks - 1)) == 0, "dt_maxQueuedTasks must be a power of two");
+
+	if (workerCount < 0)
+	{
+		int hardwareCount = int(std::thread::hardware_concurrency());
+		workerCount = hardwareCount > 1 ? hardwareCount - 1 : 0;
+	}
+
+	m_threadCount = workerCount + 1;
+	m_queues = new Queue[m_threadCount];
+	for (int i = 0; i < m_threadCount; ++i)
+	{
+		m_queues[i].top = 0;
+		m_queues[i].bottom = 0;
+	}
+
+	m_queuedCount = 0;
+	m_sleeperCount = 0;
+	m_stop = false;
+
+	m_workers.reserve(workerCount);
+	for (int i = 1; i < m_threadCount; ++i)
+	{
+		m_workers.emplace_back(&dtTaskScheduler::WorkerMain, this, i);
+	}
+}
+
+dtTaskScheduler::~dtTaskScheduler()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_sleepMutex);
+		m_stop = true;
+	}
+	m_wake.notify_all();
+
+	for (std::thread& worker : m_workers)
+	{
+		worker.join();
+	}
+
+	delete[] m_queues;
+}
+
+int dtTaskScheduler::GetThreadCount() const
+{
+	return m_threadCount;
+}
+
+int dtTaskScheduler::GetThreadIndex() const
+{
+	return t_context.scheduler == this ? t_context.index : 0;
+}
+
+void dtTaskScheduler::Run(dtTaskGroup& group, dtTaskFunction* function, void* context)
+{
+	group.pending.fetch_add(1, std::memory_order_relaxed);
+
+	Task task = { function, context, &group };
+	if (Push(GetThreadIndex(), task) == false)
+	{
+		// The queue is full, so there is plenty of work to steal already.
+		Execute(task);
+		return;
+	}
+
+	// Pairs with the sleeper count increment in WorkerMain. Either the worker sees the
+	// new task before sleeping or this thread sees the sleeper and wakes it.
+	m_queuedCount.fetch_add(1, std::memory_order_seq_cst);
+	if (m_sleeperCount.load(std::memory_order_seq_cst) > 0)
+	{
+		// Taking the lock orders the notify after a worker that is about to wait.
+		{
+			std::lock_guard<std::mutex> lock(m_sleepMutex);
+		}
+		m_wake.notify_one();
+	}
+}
+
+// Owner only. "Correct and Efficient Work-Stealing for Weak Memory Models" by Le et al.,
+// with sequentially consistent operations in place of the fences.
+bool dtTaskScheduler::Push(int threadIndex, const Task& task)
+{
+	Queue& queue = m_queues[threadIndex];
+	int bottom = queue.bottom.load(std::memory_order_relaxed);
+	int top = queue.top.load(std::memory_order_acquire);
+	if (bottom - top >= dt_maxQueuedTasks)
+	{
+		return false;
+	}
+
+	Entry& entry = queue.entries[bottom & (dt_maxQueuedTasks - 1)];
+	entry.function.store(task.function, std::memory_order_relaxed);
+	entry.context.store(task.context, std::memory_order_relaxed);
+	entry.group.store(task.group, std::memory_order_relaxed);
+
+	queue.bottom.store(bottom + 1, std::memory_order_release);
+	return true;
+}
+
+// Owner only. Takes the newest task.
+bool dtTaskScheduler::Pop(int threadIndex, Task& task)
+{
+	Queue& queue = m_queues[threadIndex];
+	int bottom = queue.bottom.load(std::memory_order_relaxed) - 1;
+	queue.bottom.store(bottom, std::memory_order_seq_cst);
+	int top = queue.top.load(std::memory_order_seq_cst);
+
+	if (top > bottom)
+	{
+		// Empty
+		queue.bottom.store(bottom + 1, std::memory_order_relaxed);
+		return false;
+	}
+
+	const Entry& entry = queue.entries[bottom & (dt_maxQueuedTasks - 1)];
+	task.function = entry.function.load(std::memory_order_relaxed);
+	task.context = entry.context.load(std::memory_order_relaxed);
+	task.group = entry.group.load(std::memory_order_relaxed);
+
+	if (top == bottom)
+	{
+		// Last task, race the thieves for it.
+		bool won = queue.top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+		queue.bottom.store(bottom + 1, std::memory_order_relaxed);
+		return won;
+	}
+
+	return true;
+}
+
+// Any thread. Takes the oldest task of another thread.
+bool dtTaskScheduler::Steal(int threadIndex, Task& task)
+{
+	Queue& queue = m_queues[threadIndex];
+	int top = queue.top.load(std::memory_order_seq_cst);
+	int bottom = queue.bottom.load(std::memory_order_seq_cst);
+	if (top >= bottom)
+	{
+		return false;
+	}
+
+	const Entry& entry = queue.entries[top & (dt_maxQueuedTasks - 1)];
+	task.function = entry.function.load(std::memory_order_relaxed);
+	task.context = entry.context.load(std::memory_order_relaxed);
+	task.group = entry.group.load(std::memory_order_relaxed);
+
+	return queue.top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+}
+
+// Newest task of the own queue first, then the oldest task of the other queues.
+bool dtTaskScheduler::Find(int threadIndex, Task& task)
+{
+	if (m_queuedCount.load(std::memory_order_relaxed) == 0)
+	{
+		return false;
+	}
+
+	if (Pop(threadIndex, task))
+	{
+		m_queuedCount.fetch_sub(1, std::memory_order_relaxed);
+		return true;
+	}
+
+	for (int i = 1; i < m_threadCount; ++i)
+	{
+		if (Steal((threadIndex + i) % m_threadCount, task))
+		{
+			m_queuedCount.fetch_sub(1, std::memory_order_relaxed);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void dtTaskScheduler::Execute(const Task& task)
+{
+	task.function(task.context);
+	task.group->pending.fetch_sub(1, std::memory_order_release);
+}
+
+void dtTaskScheduler::Wait(dtTaskGroup& group)
+{
+	int threadIndex = GetThreadIndex();
+
+	while (group.pending.load(std::memory_order_acquire) > 0)
+	{
+		Task task;
+		if (Find(threadIndex, task))
+		{
+			Execute(task);
+		}
+		else
+		{
+			// The remaining tasks are running on other threads.
+			std::this_thread::yield();
+		}
+	}
+}
+
+void dtTaskScheduler::WorkerMain(int threadIndex)
+{
+	t_context.scheduler = this;
+	t_context.index = threadIndex;
+
+	for (;;)
+	{
+		Task task;
+		if (Find(threadIndex, task))
+		{
+			Execute(task);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(m_sleepMutex);
+		m_sleeperCount.fetch_add(1, std::memory_order_seq_cst);
+		m_wake.wait(lock, [this]() { return m_stop.load() || m_queuedCount.load(std::memory_order_seq_cst) > 0; });
+		m_sleeperCount.fetch_sub(1, std::memory_order_relaxed);
+
+		if (m_stop)
+		{
+			return;
+		}
+	}
+}
@@ -11,12 +11,27 @@
 
 #define _CRT_SECURE_NO_WARNINGS
 #include "dynamic-tree/tree.h"
+#include "dynamic-tree/task_scheduler.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <algorithm>
 #include <assert.h>
 
 #define DT_VALIDATE 0
 
+// Time InsertLeaf, RemoveLeaf and Rotate per call into dtTree::m_profile.
+#ifndef DT_PROFILE
+#define DT_PROFILE 0
+#endif
+
+#if DT_PROFILE == 1
+#define DT_PROFILE_SCOPE(stat) dtScopedTimer profileTimer(stat)
+#else
+#define DT_PROFILE_SCOPE(stat)
+#endif
+
 // 
 static inline float dtManhattan(const dtAABB& a, const dtAABB& b)
 {
@@ -25,6 +40,53 @@ static inline float dtManhattan(const dtAABB& a, const dtAABB& b)
 	return dtGetX(absD) + dtGetY(absD) + dtGetZ(absD);
 }
 
+void dtSetRayPacket(dtRayPacket& packet, const dtVec* origins, const dtVec* directions, int count, float maxFraction)
+{
+	assert(0 < count && count <= dt_packetCount);
+
+	// Unused lanes repeat the first ray so they compute finite values.
+	dtVec origin[dt_packetCount];
+	dtVec invDirection[dt_packetCount];
+	for (int i = 0; i < dt_packetCount; ++i)
+	{
+		int j = i < count ? i : 0;
+		origin[i] = origins[j];
+		invDirection[i] = dtRayInverse(directions[j]);
+	}
+
+	_MM_TRANSPOSE4_PS(origin[0], origin[1], origin[2], origin[3]);
+	_MM_TRANSPOSE4_PS(invDirection[0], invDirection[1], invDirection[2], invDirection[3]);
+
+	packet.originX = origin[0];
+	packet.originY = origin[1];
+	packet.originZ = origin[2];
+	packet.invDirectionX = invDirection[0];
+	packet.invDirectionY = invDirection[1];
+	packet.invDirectionZ = invDirection[2];
+	packet.maxFraction = dtSplat(maxFraction);
+	packet.activeMask = (1 << count) - 1;
+}
+
+void dtSetRayPacket(dtRayPacket8& packet, const dtVec* origins, const dtVec* directions, int count, float maxFraction)
+{
+	assert(0 < count && count <= dt_packetCount8);
+
+	for (int i = 0; i < dt_packetCount8; ++i)
+	{
+		int j = i < count ? i : 0;
+		dtVec invDirection = dtRayInverse(directions[j]);
+		packet.originX[i] = dtGetX(origins[j]);
+		packet.originY[i] = dtGetY(origins[j]);
+		packet.originZ[i] = dtGetZ(origins[j]);
+		packet.invDirectionX[i] = dtGetX(invDirection);
+		packet.invDirectionY[i] = dtGetY(invDirection);
+		packet.invDirectionZ[i] = dtGetZ(invDirection);
+		packet.maxFraction[i] = maxFraction;
+	}
+
+	packet.activeMask = (1 << count) - 1;
+}
+
 dtTree::dtTree()
 {
 	m_root = dt_nullNode;
@@ -53,11 +115,16 @@ dtTree::dtTree()
 	m_countCE = 0;
 
 	m_path = 0;
+	m_treeletCursor = 0;
 	m_insertionCount = 0;
 	m_heap.reserve(128);
 	m_maxHeapCount = 0;
+	m_refitGeneration = 0;
 
 	m_heuristic = dt_sah;
+
+	m_aabbMargin = 0.1f;
+	m_aabbMultiplier = 4.0f;
 }
 
 dtTree::~dtTree()
@@ -84,6 +151,8 @@ void dtTree::Clear()
 
 	m_freeList = 0;
 	m_path = 0;
+	m_treeletQueue.clear();
+	m_treeletCursor = 0;
 	m_insertionCount = 0;
 
 	m_countBF = 0;
@@ -92,6 +161,53 @@ void dtTree::Clear()
 	m_countCE = 0;
 
 	m_maxHeapCount = 0;
+
+	m_profile.Reset();
+}
+
+// Copy the nodes and settings of another tree. Proxy ids stay valid in the copy.
+void dtTree::CopyFrom(const dtTree& tree)
+{
+	assert(this != &tree);
+
+	int capacity = m_nodeCapacity;
+	if (capacity < tree.m_nodeCapacity)
+	{
+		free(m_nodes);
+		capacity = tree.m_nodeCapacity;
+		m_nodes = (dtNode*)malloc(capacity * sizeof(dtNode));
+	}
+
+	memcpy(m_nodes, tree.m_nodes, tree.m_nodeCapacity * sizeof(dtNode));
+	m_freeList = tree.m_freeList;
+
+	// Put the extra nodes of a larger pool in front of the free list.
+	if (capacity > tree.m_nodeCapacity)
+	{
+		for (int i = tree.m_nodeCapacity; i < capacity - 1; ++i)
+		{
+			m_nodes[i].next = i + 1;
+			m_nodes[i].height = dt_nullNode;
+		}
+		m_nodes[capacity - 1].next = m_freeList;
+		m_nodes[capacity - 1].height = dt_nullNode;
+		m_freeList = tree.m_nodeCapacity;
+	}
+
+	m_root = tree.m_root;
+	m_nodeCapacity = capacity;
+	m_nodeCount = tree.m_nodeCount;
+	m_proxyCount = tree.m_proxyCount;
+
+	m_path = 0;
+	m_treeletQueue.clear();
+	m_treeletCursor = 0;
+
+	m_heuristic = tree.m_heuristic;
+	m_aabbMargin = tree.m_aabbMargin;
+	m_aabbMultiplier = tree.m_aabbMultiplier;
+
+	Validate();
 }
 
 //
@@ -101,6 +217,34 @@ const dtAABB& dtTree::GetAABB(int proxyId) const
 	return m_nodes[proxyId].aabb;
 }
 
+// Grow the node pool so that count more nodes can be allocated without another copy.
+void dtTree::ReserveNodes(int count)
+{
+	if (m_nodeCount + count <= m_nodeCapacity)
+	{
+		return;
+	}
+
+	// Rebuild a bigger pool.
+	int oldCapacity = m_nodeCapacity;
+	dtNode* oldNodes = m_nodes;
+	m_nodeCapacity = dtMax(2 * oldCapacity, m_nodeCount + count);
+	m_nodes = (dtNode*)malloc(m_nodeCapacity * sizeof(dtNode));
+	memcpy(m_nodes, oldNodes, oldCapacity * sizeof(dtNode));
+	free(oldNodes);
+
+	// Put the new nodes in front of the free list. The parent
+	// pointer becomes the "next" pointer.
+	for (int i = oldCapacity; i < m_nodeCapacity - 1; ++i)
+	{
+		m_nodes[i].next = i + 1;
+		m_nodes[i].height = dt_nullNode;
+	}
+	m_nodes[m_nodeCapacity-1].next = m_freeList;
+	m_nodes[m_nodeCapacity-1].height = dt_nullNode;
+	m_freeList = oldCapacity;
+}
+
 // Allocate a node from the pool. Grow the pool if necessary.
 int dtTree::AllocateNode()
 {
@@ -108,24 +252,7 @@ int dtTree::AllocateNode()
 	if (m_freeList == dt_nullNode)
 	{
 		assert(m_nodeCount == m_nodeCapacity);
-
-		// The free list is empty. Rebuild a bigger pool.
-		dtNode* oldNodes = m_nodes;
-		m_nodeCapacity *= 2;
-		m_nodes = (dtNode*)malloc(m_nodeCapacity * sizeof(dtNode));
-		memcpy(m_nodes, oldNodes, m_nodeCount * sizeof(dtNode));
-		free(oldNodes);
-
-		// Build a linked list for the free list. The parent
-		// pointer becomes the "next" pointer.
-		for (int i = m_nodeCount; i < m_nodeCapacity - 1; ++i)
-		{
-			m_nodes[i].next = i + 1;
-			m_nodes[i].height = dt_nullNode;
-		}
-		m_nodes[m_nodeCapacity-1].next = dt_nullNode;
-		m_nodes[m_nodeCapacity-1].height = dt_nullNode;
-		m_freeList = m_nodeCount;
+		ReserveNodes(1);
 	}
 
 	// Peel a node off the free list.
@@ -159,8 +286,10 @@ int dtTree::CreateProxy(const dtAABB& aabb, int objectIndex)
 {
 	int proxyId = AllocateNode();
 
-	m_nodes[proxyId].aabb.lowerBound = aabb.lowerBound;
-	m_nodes[proxyId].aabb.upperBound = aabb.upperBound;
+	// Fatten the aabb.
+	dtVec r = dtVecSet(m_aabbMargin, m_aabbMargin, m_aabbMargin);
+	m_nodes[proxyId].aabb.lowerBound = aabb.lowerBound - r;
+	m_nodes[proxyId].aabb.upperBound = aabb.upperBound + r;
 	m_nodes[proxyId].height = 0;
 	m_nodes[proxyId].objectIndex = objectIndex;
 	m_nodes[proxyId].isLeaf = true;
@@ -172,6 +301,40 @@ int dtTree::CreateProxy(const dtAABB& aabb, int objectIndex)
 	return proxyId;
 }
 
+// Create the proxies as one subtree and graft it into the tree.
+void dtTree::CreateProxies(const dtAABB* aabbs, const int* objectIndices, int count, int* proxies)
+{
+	if (count <= 0)
+	{
+		return;
+	}
+
+	// The leaves, the internal nodes of the subtree and the parent of the graft.
+	ReserveNodes(2 * count);
+
+	dtVec r = dtVecSet(m_aabbMargin, m_aabbMargin, m_aabbMargin);
+	for (int i = 0; i < count; ++i)
+	{
+		int proxyId = AllocateNode();
+		dtNode& node = m_nodes[proxyId];
+		node.aabb.lowerBound = aabbs[i].lowerBound - r;
+		node.aabb.upperBound = aabbs[i].upperBound + r;
+		node.height = 0;
+		node.objectIndex = objectIndices[i];
+		node.isLeaf = true;
+		proxies[i] = proxyId;
+	}
+
+	// PLOC reorders the array it is given.
+	m_buildScratch.assign(proxies, proxies + count);
+	int subtree = BuildPLOC(m_buildScratch.data(), count, 16, nullptr);
+
+	// The subtree root is placed like a leaf, at the sibling of least SAH cost.
+	InsertLeafBittner(subtree);
+
+	m_proxyCount += count;
+}
+
 //
 void dtTree::DestroyProxy(int proxyId)
 {
@@ -184,13 +347,285 @@ void dtTree::DestroyProxy(int proxyId)
 	--m_proxyCount;
 }
 
+// Unlink all the leaves first and refit the shared ancestors once at the end.
+void dtTree::DestroyProxies(const int* proxies, int count)
+{
+	// Grandparents of removed leaves, which lost a level of their subtree.
+	std::vector<int>& dirtyNodes = m_refitNodes;
+	dirtyNodes.clear();
+
+	for (int i = 0; i < count; ++i)
+	{
+		int leaf = proxies[i];
+		assert(0 <= leaf && leaf < m_nodeCapacity);
+		assert(m_nodes[leaf].isLeaf);
+
+		if (leaf == m_root)
+		{
+			m_root = dt_nullNode;
+			FreeNode(leaf);
+			continue;
+		}
+
+		int parent = m_nodes[leaf].parent;
+		int grandParent = m_nodes[parent].parent;
+		int sibling = m_nodes[parent].child1 == leaf ? m_nodes[parent].child2 : m_nodes[parent].child1;
+
+		// Connect the sibling to the grand parent. Bounds are fixed later.
+		if (grandParent != dt_nullNode)
+		{
+			if (m_nodes[grandParent].child1 == parent)
+			{
+				m_nodes[grandParent].child1 = sibling;
+			}
+			else
+			{
+				m_nodes[grandParent].child2 = sibling;
+			}
+
+			dirtyNodes.push_back(grandParent);
+		}
+		else
+		{
+			m_root = sibling;
+		}
+
+		m_nodes[sibling].parent = grandParent;
+		FreeNode(parent);
+		FreeNode(leaf);
+	}
+
+	m_proxyCount -= count;
+
+	if (m_root == dt_nullNode)
+	{
+		return;
+	}
+
+	// Nothing was allocated above, so freed nodes are still marked free.
+	int liveCount = 0;
+	for (int index : dirtyNodes)
+	{
+		if (m_nodes[index].height != dt_nullNode)
+		{
+			dirtyNodes[liveCount++] = index;
+		}
+	}
+
+	RefitAncestors(dirtyNodes.data(), liveCount, nullptr);
+
+	Validate();
+}
+
+void dtTree::Refit(const int* proxies, const dtAABB* aabbs, int count, dtTaskScheduler* scheduler)
+{
+	if (count <= 0)
+	{
+		return;
+	}
+
+	std::vector<int>& parents = m_refitNodes;
+	parents.resize(count);
+
+	dtVec r = dtVecSet(m_aabbMargin, m_aabbMargin, m_aabbMargin);
+	for (int i = 0; i < count; ++i)
+	{
+		int proxyId = proxies[i];
+		assert(0 <= proxyId && proxyId < m_nodeCapacity);
+		assert(m_nodes[proxyId].isLeaf);
+
+		m_nodes[proxyId].aabb.lowerBound = aabbs[i].lowerBound - r;
+		m_nodes[proxyId].aabb.upperBound = aabbs[i].upperBound + r;
+		parents[i] = m_nodes[proxyId].parent;
+	}
+
+	if (m_root != dt_nullNode)
+	{
+		RefitAncestors(parents.data(), count, scheduler);
+	}
+
+	Validate();
+}
+
+// Refit the marked internal nodes below index, children first.
+static void dtRefitSubtree(dtNode* nodes, const uint32_t* marks, uint32_t generation, int index)
+{
+	dtGrowableStack<int, 256> refitNodes;
+	dtGrowableStack<int, 256> stack;
+	stack.Push(index);
+
+	while (stack.GetCount() > 0)
+	{
+		index = stack.Pop();
+		refitNodes.Push(index);
+
+		const dtNode& node = nodes[index];
+		if (marks[node.child1] == generation)
+		{
+			stack.Push(node.child1);
+		}
+
+		if (marks[node.child2] == generation)
+		{
+			stack.Push(node.child2);
+		}
+	}
+
+	while (refitNodes.GetCount() > 0)
+	{
+		dtNode& node = nodes[refitNodes.Pop()];
+		node.aabb = dtUnion(nodes[node.child1].aabb, nodes[node.child2].aabb);
+		node.height = 1 + dtMax(nodes[node.child1].height, nodes[node.child2].height);
+	}
+}
+
+// Refit the given internal nodes and their ancestors so each node is visited once.
+// With a scheduler the upper levels are split into disjoint subtrees that are refit
+// in parallel before the upper levels are refit on this thread.
+void dtTree::RefitAncestors(const int* nodes, int count, dtTaskScheduler* scheduler)
+{
+	// New entries are zero, which is never the current generation.
+	if (int(m_refitMarks.size()) < m_nodeCapacity)
+	{
+		m_refitMarks.resize(m_nodeCapacity, 0);
+	}
+
+	++m_refitGeneration;
+	if (m_refitGeneration == 0)
+	{
+		// Wrapped around, so old marks could match again.
+		std::fill(m_refitMarks.begin(), m_refitMarks.end(), 0);
+		m_refitGeneration = 1;
+	}
+
+	uint32_t generation = m_refitGeneration;
+	uint32_t* marks = m_refitMarks.data();
+	for (int i = 0; i < count; ++i)
+	{
+		int index = nodes[i];
+		while (index != dt_nullNode && marks[index] != generation)
+		{
+			assert(m_nodes[index].isLeaf == false);
+			marks[index] = generation;
+			index = m_nodes[index].parent;
+		}
+	}
+
+	if (marks[m_root] != generation)
+	{
+		return;
+	}
+
+	std::vector<int> roots;
+	roots.push_back(m_root);
+
+	// Upper nodes level by level, refit after the subtrees below them.
+	std::vector<int> upperNodes;
+
+	if (scheduler != nullptr && scheduler->GetThreadCount() > 1)
+	{
+		int targetCount = 8 * scheduler->GetThreadCount();
+		std::vector<int> nextRoots;
+		while (roots.empty() == false && int(roots.size()) < targetCount)
+		{
+			nextRoots.clear();
+			for (int index : roots)
+			{
+				upperNodes.push_back(index);
+
+				const dtNode& node = m_nodes[index];
+				if (marks[node.child1] == generation)
+				{
+					nextRoots.push_back(node.child1);
+				}
+
+				if (marks[node.child2] == generation)
+				{
+					nextRoots.push_back(node.child2);
+				}
+			}
+
+			roots.swap(nextRoots);
+		}
+
+		dtNode* treeNodes = m_nodes;
+		const int* subtreeRoots = roots.data();
+		scheduler->ParallelFor(int(roots.size()), 1, [treeNodes, marks, generation, subtreeRoots](int begin, int end)
+		{
+			for (int i = begin; i < end; ++i)
+			{
+				dtRefitSubtree(treeNodes, marks, generation, subtreeRoots[i]);
+			}
+		});
+	}
+	else
+	{
+		dtRefitSubtree(m_nodes, marks, generation, m_root);
+	}
+
+	for (int i = int(upperNodes.size()) - 1; i >= 0; --i)
+	{
+		dtNode& node = m_nodes[upperNodes[i]];
+		node.aabb = dtUnion(m_nodes[node.child1].aabb, m_nodes[node.child2].aabb);
+		node.height = 1 + dtMax(m_nodes[node.child1].height, m_nodes[node.child2].height);
+	}
+}
+
+//
+bool dtTree::MoveProxy(int proxyId, const dtAABB& aabb, const dtVec& displacement)
+{
+	assert(0 <= proxyId && proxyId < m_nodeCapacity);
+	assert(m_nodes[proxyId].isLeaf);
+
+	// Extend AABB
+	dtVec r = dtVecSet(m_aabbMargin, m_aabbMargin, m_aabbMargin);
+	dtAABB fatAABB;
+	fatAABB.lowerBound = aabb.lowerBound - r;
+	fatAABB.upperBound = aabb.upperBound + r;
+
+	// Predict AABB movement
+	dtVec d = m_aabbMultiplier * displacement;
+	fatAABB.lowerBound = fatAABB.lowerBound + dtMin(d, dtVec_Zero);
+	fatAABB.upperBound = fatAABB.upperBound + dtMax(d, dtVec_Zero);
+
+	const dtAABB& treeAABB = m_nodes[proxyId].aabb;
+	if (dtContains(treeAABB, aabb))
+	{
+		// The tree AABB still contains the object, but it might be too large.
+		// Perhaps the object was moving fast but has since come to rest.
+		// The huge AABB is larger than the new fat AABB.
+		dtVec hugeR = 4.0f * r;
+		dtAABB hugeAABB;
+		hugeAABB.lowerBound = fatAABB.lowerBound - hugeR;
+		hugeAABB.upperBound = fatAABB.upperBound + hugeR;
+
+		if (dtContains(hugeAABB, treeAABB))
+		{
+			// The tree AABB contains the object AABB and the tree AABB is
+			// not too large. No tree update needed.
+			return false;
+		}
+
+		// Otherwise the tree AABB is huge and needs to be shrunk
+	}
+
+	RemoveLeaf(proxyId);
+
+	m_nodes[proxyId].aabb = fatAABB;
+
+	InsertLeaf(proxyId);
+
+	return true;
+}
+
 static inline bool operator < (const dtCandidateNode& a, const dtCandidateNode& b)
 {
 	return a.inheritanceCost > b.inheritanceCost;
 }
 
 // Insert using branch and bound. Push children without consideration.
-void dtTree::InsertLeafBittner(int leaf)
+// Returns the increase in internal node area.
+float dtTree::InsertLeafBittner(int leaf)
 {
 	++m_insertionCount;
 
@@ -198,7 +633,7 @@ void dtTree::InsertLeafBittner(int leaf)
 	{
 		m_root = leaf;
 		m_nodes[m_root].parent = dt_nullNode;
-		return;
+		return 0.0f;
 	}
 
 	dtAABB aabbL = m_nodes[leaf].aabb;
@@ -360,6 +795,8 @@ void dtTree::InsertLeafBittner(int leaf)
 	}
 
 	Validate();
+
+	return bestCost;
 }
 
 // Insert using branch and bound. Consider children before pushing.
@@ -1206,6 +1643,8 @@ void dtTree::InsertLeafManhattan(int leaf)
 
 void dtTree::InsertLeaf(int leaf)
 {
+	DT_PROFILE_SCOPE(m_profile.insertLeaf);
+
 	switch (m_heuristic)
 	{
 	case dt_sah:
@@ -1230,6 +1669,8 @@ void dtTree::InsertLeaf(int leaf)
 
 void dtTree::RemoveLeaf(int leaf)
 {
+	DT_PROFILE_SCOPE(m_profile.removeLeaf);
+
 	if (leaf == m_root)
 	{
 		m_root = dt_nullNode;
@@ -1301,6 +1742,8 @@ enum dtTreeRotate
 // Returns the new root index.
 void dtTree::Rotate(int iA)
 {
+	DT_PROFILE_SCOPE(m_profile.rotate);
+
 	assert(iA != dt_nullNode);
 
 	dtNode* A = m_nodes + iA;
@@ -1627,7 +2070,7 @@ void dtTree::Optimize(int iterations)
 {
 	for (int i = 0; i < iterations; ++i)
 	{
-		if (m_path > m_nodeCapacity)
+		if (m_path >= m_nodeCapacity)
 		{
 			m_path = 0;
 		}
@@ -1635,7 +2078,7 @@ void dtTree::Optimize(int iterations)
 		while (m_nodes[m_path].height == dt_nullNode || m_nodes[m_path].height < 2)
 		{
 			++m_path;
-			if (m_path > m_nodeCapacity)
+			if (m_path >= m_nodeCapacity)
 			{
 				m_path = 0;
 			}
@@ -1647,34 +2090,446 @@ void dtTree::Optimize(int iterations)
 	}
 }
 
-int dtTree::GetProxyCount() const
-{
-	return m_proxyCount;
-}
+#define dt_treeletLeafCount 7
+#define dt_treeletSubsetCount (1 << dt_treeletLeafCount)
 
-int dtTree::GetHeight() const
+// Find the topology of the treelet rooted at index with the least internal node area.
+// "Fast Parallel Construction of High-Quality Bounding Volume Hierarchies" by Tero Karras and Timo Aila
+// The treelet grows from the children of the root by opening the leaf with the
+// largest area. The internal nodes are reused for the new topology so proxy ids and
+// the root index are kept. Returns true if the treelet was changed.
+bool dtTree::RestructureTreelet(int index)
 {
-	if (m_root == dt_nullNode)
-	{
-		return 0;
-	}
+	int leaves[dt_treeletLeafCount];
+	int internals[dt_treeletLeafCount - 1];
+
+	const dtNode& root = m_nodes[index];
+	assert(root.isLeaf == false);
+	leaves[0] = root.child1;
+	leaves[1] = root.child2;
+	internals[0] = index;
+	int leafCount = 2;
+	int internalCount = 1;
+
+	float oldCost = dtArea(root.aabb);
+	while (leafCount < dt_treeletLeafCount)
+	{
+		int bestLeaf = -1;
+		float bestArea = -FLT_MAX;
+		for (int i = 0; i < leafCount; ++i)
+		{
+			const dtNode& node = m_nodes[leaves[i]];
+			if (node.isLeaf)
+			{
+				continue;
+			}
 
-	return m_nodes[m_root].height;
-}
+			float area = dtArea(node.aabb);
+			if (area > bestArea)
+			{
+				bestLeaf = i;
+				bestArea = area;
+			}
+		}
 
-//
-float dtTree::GetAreaRatio() const
-{
-	if (m_root == dt_nullNode)
+		if (bestLeaf == -1)
+		{
+			break;
+		}
+
+		int opened = leaves[bestLeaf];
+		internals[internalCount++] = opened;
+		oldCost += bestArea;
+
+		leaves[bestLeaf] = m_nodes[opened].child1;
+		leaves[leafCount++] = m_nodes[opened].child2;
+	}
+
+	if (leafCount < 3)
 	{
-		return 0.0f;
+		return false;
 	}
 
-	const dtNode* root = m_nodes + m_root;
-	float rootArea = dtArea(root->aabb);
+	// Bounds of every subset of the leaves
+	dtAABB boxes[dt_treeletSubsetCount];
+	for (int i = 0; i < leafCount; ++i)
+	{
+		boxes[1 << i] = m_nodes[leaves[i]].aabb;
+	}
 
-	float totalArea = 0.0f;
-	for (int i = 0; i < m_nodeCapacity; ++i)
+	int fullSet = (1 << leafCount) - 1;
+	for (int set = 1; set <= fullSet; ++set)
+	{
+		int lowBit = set & -set;
+		if (set != lowBit)
+		{
+			boxes[set] = dtUnion(boxes[set ^ lowBit], boxes[lowBit]);
+		}
+	}
+
+	// Least internal area of a subtree over each subset. The subsets of a set are
+	// smaller numbers, so one ascending pass suffices. Partitions are only listed
+	// once by keeping the lowest bit on the left.
+	float costs[dt_treeletSubsetCount];
+	unsigned char splits[dt_treeletSubsetCount];
+	for (int set = 1; set <= fullSet; ++set)
+	{
+		int lowBit = set & -set;
+		if (set == lowBit)
+		{
+			costs[set] = 0.0f;
+			splits[set] = 0;
+			continue;
+		}
+
+		float bestCost = FLT_MAX;
+		int bestSplit = 0;
+		for (int left = (set - 1) & set; left > 0; left = (left - 1) & set)
+		{
+			if ((left & lowBit) == 0)
+			{
+				continue;
+			}
+
+			float cost = costs[left] + costs[set ^ left];
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestSplit = left;
+			}
+		}
+
+		costs[set] = dtArea(boxes[set]) + bestCost;
+		splits[set] = (unsigned char)bestSplit;
+	}
+
+	// Skip changes within round off
+	if (costs[fullSet] >= oldCost * (1.0f - 1.0e-5f))
+	{
+		return false;
+	}
+
+	// Emit the new topology top down, then fix the heights bottom up. The root keeps
+	// its index, parent and bounds.
+	struct Entry
+	{
+		int set;
+		int node;
+	};
+
+	Entry stack[dt_treeletLeafCount];
+	int stackCount = 0;
+	stack[stackCount++] = { fullSet, index };
+
+	int order[dt_treeletLeafCount - 1];
+	int orderCount = 0;
+	int nextInternal = 1;
+
+	while (stackCount > 0)
+	{
+		Entry entry = stack[--stackCount];
+		order[orderCount++] = entry.node;
+
+		int childSets[2] = { splits[entry.set], entry.set ^ splits[entry.set] };
+		int children[2];
+		for (int i = 0; i < 2; ++i)
+		{
+			int childSet = childSets[i];
+			if ((childSet & (childSet - 1)) == 0)
+			{
+				// Single leaf
+				int bit = 0;
+				while ((1 << bit) != childSet)
+				{
+					++bit;
+				}
+				children[i] = leaves[bit];
+			}
+			else
+			{
+				children[i] = internals[nextInternal++];
+				m_nodes[children[i]].aabb = boxes[childSet];
+				stack[stackCount++] = { childSet, children[i] };
+			}
+
+			m_nodes[children[i]].parent = entry.node;
+		}
+
+		m_nodes[entry.node].child1 = children[0];
+		m_nodes[entry.node].child2 = children[1];
+	}
+
+	assert(nextInternal == internalCount);
+
+	// Parents were emitted before their children
+	for (int i = orderCount - 1; i >= 0; --i)
+	{
+		dtNode& node = m_nodes[order[i]];
+		node.height = 1 + dtMax(m_nodes[node.child1].height, m_nodes[node.child2].height);
+	}
+
+	// The root height may have changed
+	int ancestor = m_nodes[index].parent;
+	while (ancestor != dt_nullNode)
+	{
+		dtNode& node = m_nodes[ancestor];
+		int height = 1 + dtMax(m_nodes[node.child1].height, m_nodes[node.child2].height);
+		if (height == node.height)
+		{
+			break;
+		}
+
+		node.height = height;
+		ancestor = node.parent;
+	}
+
+	return true;
+}
+
+int dtTree::OptimizeTreelets(int iterations, float maxMilliseconds)
+{
+	dtTimer timer;
+	int changeCount = 0;
+
+	for (int i = 0; i < iterations; ++i)
+	{
+		if (m_treeletCursor >= int(m_treeletQueue.size()))
+		{
+			// Start a new pass over the internal nodes, lowest first.
+			m_treeletQueue.clear();
+			m_treeletCursor = 0;
+
+			for (int j = 0; j < m_nodeCapacity; ++j)
+			{
+				if (m_nodes[j].height >= 2)
+				{
+					m_treeletQueue.push_back(j);
+				}
+			}
+
+			if (m_treeletQueue.empty())
+			{
+				break;
+			}
+
+			std::stable_sort(m_treeletQueue.begin(), m_treeletQueue.end(), [this](int a, int b)
+			{
+				return m_nodes[a].height < m_nodes[b].height;
+			});
+		}
+
+		// The tree may have changed since the pass started.
+		int index = m_treeletQueue[m_treeletCursor++];
+		if (m_nodes[index].height >= 2)
+		{
+			if (RestructureTreelet(index))
+			{
+				++changeCount;
+			}
+		}
+
+		if (maxMilliseconds > 0.0f && timer.GetMilliseconds() > maxMilliseconds)
+		{
+			break;
+		}
+	}
+
+	Validate();
+
+	return changeCount;
+}
+
+// Reinsert the children of the internal nodes that waste the most area.
+// "Fast Insertion-Based Optimization of Bounding Volume Hierarchies" by Jiri Bittner et al.
+// Removing a node also removes its parent, so the two orphaned subtrees are inserted
+// with the branch and bound search of InsertLeafBittner and reuse the two freed nodes.
+// A reinsertion that does not lower the internal node area is undone.
+int dtTree::OptimizeReinsertion(float maxMilliseconds, float batchFraction)
+{
+	struct Candidate
+	{
+		float ratio;
+		int index;
+	};
+
+	dtTimer timer;
+	int reinsertCount = 0;
+	std::vector<Candidate> candidates;
+	std::vector<float> ancestorAreas;
+
+	bool improved = true;
+	while (improved && m_root != dt_nullNode && timer.GetMilliseconds() < maxMilliseconds)
+	{
+		improved = false;
+
+		// Rank the internal nodes below the root by area relative to their children.
+		candidates.clear();
+		dtGrowableStack<int, 256> stack;
+		stack.Push(m_root);
+		while (stack.GetCount() > 0)
+		{
+			int index = stack.Pop();
+			const dtNode& node = m_nodes[index];
+			if (node.isLeaf)
+			{
+				continue;
+			}
+
+			stack.Push(node.child1);
+			stack.Push(node.child2);
+
+			if (index == m_root)
+			{
+				continue;
+			}
+
+			float childArea = dtArea(m_nodes[node.child1].aabb) + dtArea(m_nodes[node.child2].aabb);
+			candidates.push_back({ dtArea(node.aabb) / dtMax(childArea, FLT_MIN), index });
+		}
+
+		if (candidates.empty())
+		{
+			break;
+		}
+
+		int batchCount = dtMax(1, int(batchFraction * candidates.size()));
+		batchCount = dtMin(batchCount, int(candidates.size()));
+		std::partial_sort(candidates.begin(), candidates.begin() + batchCount, candidates.end(),
+			[](const Candidate& a, const Candidate& b) { return a.ratio > b.ratio; });
+
+		for (int i = 0; i < batchCount; ++i)
+		{
+			// Earlier reinsertions in this batch may have moved or recycled the node.
+			int index = candidates[i].index;
+			if (m_nodes[index].height < 1 || index == m_root)
+			{
+				continue;
+			}
+
+			int child1 = m_nodes[index].child1;
+			int child2 = m_nodes[index].child2;
+			int parent = m_nodes[index].parent;
+			int grandParent = m_nodes[parent].parent;
+			int sibling = m_nodes[parent].child1 == index ? m_nodes[parent].child2 : m_nodes[parent].child1;
+
+			// The removal drops the node and its parent and shrinks the ancestors above.
+			float removedArea = dtArea(m_nodes[index].aabb) + dtArea(m_nodes[parent].aabb);
+			ancestorAreas.clear();
+			for (int j = grandParent; j != dt_nullNode; j = m_nodes[j].parent)
+			{
+				ancestorAreas.push_back(dtArea(m_nodes[j].aabb));
+			}
+
+			RemoveLeaf(index);
+			FreeNode(index);
+
+			float delta = -removedArea;
+			int ancestorIndex = 0;
+			for (int j = grandParent; j != dt_nullNode; j = m_nodes[j].parent)
+			{
+				delta += dtArea(m_nodes[j].aabb) - ancestorAreas[ancestorIndex];
+				++ancestorIndex;
+			}
+
+			// The larger subtree goes first since it has fewer good locations.
+			if (dtArea(m_nodes[child1].aabb) < dtArea(m_nodes[child2].aabb))
+			{
+				dtSwap(child1, child2);
+			}
+
+			delta += InsertLeafBittner(child1);
+			delta += InsertLeafBittner(child2);
+
+			if (delta < -0.0001f * removedArea)
+			{
+				++reinsertCount;
+				improved = true;
+			}
+			else
+			{
+				// No cheaper location. Removing in reverse order restores the tree as it was
+				// after the removal, then the children go back under the original parent.
+				RemoveLeaf(child2);
+				RemoveLeaf(child1);
+
+				int newIndex = AllocateNode();
+				int newParent = AllocateNode();
+
+				m_nodes[newIndex].child1 = child1;
+				m_nodes[newIndex].child2 = child2;
+				m_nodes[newIndex].parent = newParent;
+				m_nodes[newIndex].aabb = dtUnion(m_nodes[child1].aabb, m_nodes[child2].aabb);
+				m_nodes[newIndex].height = 1 + dtMax(m_nodes[child1].height, m_nodes[child2].height);
+				m_nodes[child1].parent = newIndex;
+				m_nodes[child2].parent = newIndex;
+
+				m_nodes[newParent].child1 = sibling;
+				m_nodes[newParent].child2 = newIndex;
+				m_nodes[newParent].parent = grandParent;
+				m_nodes[sibling].parent = newParent;
+
+				if (grandParent == dt_nullNode)
+				{
+					m_root = newParent;
+				}
+				else if (m_nodes[grandParent].child1 == sibling)
+				{
+					m_nodes[grandParent].child1 = newParent;
+				}
+				else
+				{
+					m_nodes[grandParent].child2 = newParent;
+				}
+
+				for (int j = newParent; j != dt_nullNode; j = m_nodes[j].parent)
+				{
+					int c1 = m_nodes[j].child1;
+					int c2 = m_nodes[j].child2;
+					m_nodes[j].aabb = dtUnion(m_nodes[c1].aabb, m_nodes[c2].aabb);
+					m_nodes[j].height = 1 + dtMax(m_nodes[c1].height, m_nodes[c2].height);
+				}
+			}
+
+			if (timer.GetMilliseconds() >= maxMilliseconds)
+			{
+				break;
+			}
+		}
+	}
+
+	Validate();
+
+	return reinsertCount;
+}
+
+int dtTree::GetProxyCount() const
+{
+	return m_proxyCount;
+}
+
+int dtTree::GetHeight() const
+{
+	if (m_root == dt_nullNode)
+	{
+		return 0;
+	}
+
+	return m_nodes[m_root].height;
+}
+
+//
+float dtTree::GetAreaRatio() const
+{
+	if (m_root == dt_nullNode)
+	{
+		return 0.0f;
+	}
+
+	const dtNode* root = m_nodes + m_root;
+	float rootArea = dtArea(root->aabb);
+
+	float totalArea = 0.0f;
+	for (int i = 0; i < m_nodeCapacity; ++i)
 	{
 		const dtNode* node = m_nodes + i;
 		if (node->height < 0 || node->isLeaf || i == m_root)
@@ -1799,8 +2654,8 @@ void dtTree::ValidateMetrics(int index) const
 
 	dtAABB aabb = dtUnion(m_nodes[child1].aabb, m_nodes[child2].aabb);
 
-	assert(aabb.lowerBound == node->aabb.lowerBound);
-	assert(aabb.upperBound == node->aabb.upperBound);
+	assert(dtIsEqual(aabb.lowerBound, node->aabb.lowerBound));
+	assert(dtIsEqual(aabb.upperBound, node->aabb.upperBound));
 
 	ValidateMetrics(child1);
 	ValidateMetrics(child2);
@@ -1924,84 +2779,258 @@ void dtTree::RebuildBottomUp()
 	Validate();
 }
 
-void dtTree::WriteDot(const char* fileName) const
+static void dtSortMorton(const dtAABB* boxes, int count, std::vector<uint32_t>& codes, std::vector<int>& order,
+	std::vector<uint32_t>& tempCodes, std::vector<int>& tempOrder);
+
+// "Parallel Locally-Ordered Clustering for Bounding Volume Hierarchy Construction"
+// by Daniel Meister and Jiri Bittner
+// The clusters are kept in Morton order. Every round each cluster finds the cluster
+// within radius positions that gives the smallest union area. Mutual nearest
+// neighbors are merged and the merged cluster takes the lower slot. Equal costs are
+// broken by index so the globally cheapest pair is always mutual and every round
+// merges at least once. The neighbor search dominates and runs in parallel when a
+// scheduler is given. Internal nodes are taken from the pool.
+int dtTree::BuildPLOC(int* clusters, int count, int radius, dtTaskScheduler* scheduler)
 {
-	FILE* file = fopen(fileName, "w");
-	if (file == nullptr)
+	assert(radius > 0);
+
+	if (count <= 0)
 	{
-		return;
+		return dt_nullNode;
 	}
 
-	float areaRatio = GetAreaRatio();
+	// Cluster bounds in a compact array for the neighbor search
+	std::vector<dtAABB> boxes(count);
+	for (int i = 0; i < count; ++i)
+	{
+		boxes[i] = m_nodes[clusters[i]].aabb;
+	}
 
-	if (m_proxyCount < 26)
 	{
-		fprintf(file, "graph\n");
-		fprintf(file, "{\n");
+		std::vector<uint32_t> codes;
+		std::vector<int> order;
+		std::vector<uint32_t> tempCodes;
+		std::vector<int> tempOrder;
+		dtSortMorton(boxes.data(), count, codes, order, tempCodes, tempOrder);
 
-		for (int i = 0; i < m_nodeCapacity; ++i)
+		for (int i = 0; i < count; ++i)
 		{
-			if (m_nodes[i].height == -1)
-			{
-				continue;
-			}
+			tempOrder[i] = clusters[order[i]];
+		}
 
-			if (m_nodes[i].isLeaf)
-			{
-				fprintf(file, "%d [shape=box, width=0.25, height=0.25, label=\"%c\"]\n", i, 'A' + m_nodes[i].objectIndex);
-			}
-			else
-			{
-				fprintf(file, "%d [shape=circle, width=0.25, height=0.25, label=\"\"]\n", i);
-			}
+		std::vector<dtAABB> sortedBoxes(count);
+		for (int i = 0; i < count; ++i)
+		{
+			clusters[i] = tempOrder[i];
+			sortedBoxes[i] = boxes[order[i]];
 		}
 
-		for (int i = 0; i < m_nodeCapacity; ++i)
+		boxes.swap(sortedBoxes);
+	}
+
+	std::vector<int> neighbors(count);
+
+	auto findNeighbors = [&boxes, &neighbors, &count, radius](int begin, int end)
+	{
+		for (int i = begin; i < end; ++i)
 		{
-			if (m_nodes[i].height == -1)
-			{
-				continue;
-			}
+			int first = dtMax(0, i - radius);
+			int last = dtMin(count - 1, i + radius);
 
-			if (m_nodes[i].isLeaf)
+			float bestCost = FLT_MAX;
+			int best = -1;
+			for (int j = first; j <= last; ++j)
 			{
-				continue;
+				if (j == i)
+				{
+					continue;
+				}
+
+				float cost = dtArea(dtUnion(boxes[i], boxes[j]));
+				if (cost < bestCost)
+				{
+					bestCost = cost;
+					best = j;
+				}
 			}
 
-			fprintf(file, "%d -- %d\n", i, m_nodes[i].child1);
-			fprintf(file, "%d -- %d\n", i, m_nodes[i].child2);
+			neighbors[i] = best;
 		}
+	};
 
-		fprintf(file, "%d [shape=box, fontsize=10, label=\"area ratio = %.2f\"]\n", m_nodeCapacity, areaRatio);
-		fprintf(file, "}\n");
-	}
-	else
+	while (count > 1)
 	{
-		fprintf(file, "graph\n");
-		fprintf(file, "{\n");
-		for (int i = 0; i < m_nodeCapacity; ++i)
+		if (scheduler != nullptr)
 		{
-			if (m_nodes[i].height == -1)
-			{
-				continue;
-			}
-
-			if (m_nodes[i].isLeaf)
-			{
-				fprintf(file, "%d [shape=point]\n", i);
-			}
-			else
-			{
-				float area = dtArea(m_nodes[i].aabb);
-				fprintf(file, "%d [shape=circle, label=\"%.f\"]\n", i, area);
-			}
+			scheduler->ParallelFor(count, 256, findNeighbors);
+		}
+		else
+		{
+			findNeighbors(0, count);
 		}
 
-		for (int i = 0; i < m_nodeCapacity; ++i)
+		// Merge mutual neighbors into the lower slot and compact
+		int newCount = 0;
+		for (int i = 0; i < count; ++i)
 		{
-			if (m_nodes[i].height == -1)
+			int j = neighbors[i];
+			if (neighbors[j] == i)
 			{
-				continue;
+				if (j < i)
+				{
+					// Merged into slot j
+					continue;
+				}
+
+				int child1 = clusters[i];
+				int child2 = clusters[j];
+
+				int parentIndex = AllocateNode();
+				dtNode* parent = m_nodes + parentIndex;
+				parent->child1 = child1;
+				parent->child2 = child2;
+				parent->height = 1 + dtMax(m_nodes[child1].height, m_nodes[child2].height);
+				parent->aabb = dtUnion(boxes[i], boxes[j]);
+				parent->parent = dt_nullNode;
+
+				m_nodes[child1].parent = parentIndex;
+				m_nodes[child2].parent = parentIndex;
+
+				clusters[newCount] = parentIndex;
+				boxes[newCount] = parent->aabb;
+				++newCount;
+				continue;
+			}
+
+			clusters[newCount] = clusters[i];
+			boxes[newCount] = boxes[i];
+			++newCount;
+		}
+
+		assert(newCount < count);
+		count = newCount;
+	}
+
+	return clusters[0];
+}
+
+void dtTree::RebuildPLOC(int radius, dtTaskScheduler* scheduler)
+{
+	if (m_root == dt_nullNode)
+	{
+		return;
+	}
+
+	std::vector<int> leaves;
+	leaves.reserve(m_proxyCount);
+
+	// Build array of leaves. Free the rest.
+	for (int i = 0; i < m_nodeCapacity; ++i)
+	{
+		if (m_nodes[i].height < 0)
+		{
+			// node unused
+			continue;
+		}
+
+		if (m_nodes[i].isLeaf)
+		{
+			m_nodes[i].parent = dt_nullNode;
+			leaves.push_back(i);
+		}
+		else
+		{
+			FreeNode(i);
+		}
+	}
+
+	m_root = BuildPLOC(leaves.data(), int(leaves.size()), radius, scheduler);
+	if (m_root != dt_nullNode)
+	{
+		m_nodes[m_root].parent = dt_nullNode;
+	}
+
+	Validate();
+}
+
+void dtTree::WriteDot(const char* fileName) const
+{
+	FILE* file = fopen(fileName, "w");
+	if (file == nullptr)
+	{
+		return;
+	}
+
+	float areaRatio = GetAreaRatio();
+
+	if (m_proxyCount < 26)
+	{
+		fprintf(file, "graph\n");
+		fprintf(file, "{\n");
+
+		for (int i = 0; i < m_nodeCapacity; ++i)
+		{
+			if (m_nodes[i].height == -1)
+			{
+				continue;
+			}
+
+			if (m_nodes[i].isLeaf)
+			{
+				fprintf(file, "%d [shape=box, width=0.25, height=0.25, label=\"%c\"]\n", i, 'A' + m_nodes[i].objectIndex);
+			}
+			else
+			{
+				fprintf(file, "%d [shape=circle, width=0.25, height=0.25, label=\"\"]\n", i);
+			}
+		}
+
+		for (int i = 0; i < m_nodeCapacity; ++i)
+		{
+			if (m_nodes[i].height == -1)
+			{
+				continue;
+			}
+
+			if (m_nodes[i].isLeaf)
+			{
+				continue;
+			}
+
+			fprintf(file, "%d -- %d\n", i, m_nodes[i].child1);
+			fprintf(file, "%d -- %d\n", i, m_nodes[i].child2);
+		}
+
+		fprintf(file, "%d [shape=box, fontsize=10, label=\"area ratio = %.2f\"]\n", m_nodeCapacity, areaRatio);
+		fprintf(file, "}\n");
+	}
+	else
+	{
+		fprintf(file, "graph\n");
+		fprintf(file, "{\n");
+		for (int i = 0; i < m_nodeCapacity; ++i)
+		{
+			if (m_nodes[i].height == -1)
+			{
+				continue;
+			}
+
+			if (m_nodes[i].isLeaf)
+			{
+				fprintf(file, "%d [shape=point]\n", i);
+			}
+			else
+			{
+				float area = dtArea(m_nodes[i].aabb);
+				fprintf(file, "%d [shape=circle, label=\"%.f\"]\n", i, area);
+			}
+		}
+
+		for (int i = 0; i < m_nodeCapacity; ++i)
+		{
+			if (m_nodes[i].height == -1)
+			{
+				continue;
 			}
 
 			if (m_nodes[i].isLeaf)
@@ -2036,6 +3065,104 @@ struct dtTreePlane
 	int rightCount;
 };
 
+// The split axis is the longest axis of the centroid bounds. Returns the axis
+// and the inverse centroid extent along it for binning.
+static int dtChooseSplitAxis(const dtAABB& centroidAABB, float& invD)
+{
+	dtVec d = centroidAABB.upperBound - centroidAABB.lowerBound;
+
+	int axisIndex;
+	if (dtGetX(d) > dtGetY(d) && dtGetX(d) > dtGetZ(d))
+	{
+		axisIndex = 0;
+		invD = dtGetX(d);
+	}
+	else if (dtGetY(d) > dtGetZ(d))
+	{
+		axisIndex = 1;
+		invD = dtGetY(d);
+	}
+	else
+	{
+		axisIndex = 2;
+		invD = dtGetZ(d);
+	}
+
+	invD = invD > 0.0f ? 1.0f / invD : 0.0f;
+	return axisIndex;
+}
+
+// Sweep the bins from both sides and return the plane with the least SAH cost.
+static int dtFindBestPlane(const dtTreeBin* bins, dtTreePlane* planes)
+{
+	int planeCount = dt_binCount - 1;
+
+	planes[0].leftCount = bins[0].count;
+	planes[0].leftAABB = bins[0].aabb;
+	for (int i = 1; i < planeCount; ++i)
+	{
+		planes[i].leftCount = planes[i - 1].leftCount + bins[i].count;
+		planes[i].leftAABB = dtUnion(planes[i - 1].leftAABB, bins[i].aabb);
+	}
+
+	planes[planeCount - 1].rightCount = bins[planeCount].count;
+	planes[planeCount - 1].rightAABB = bins[planeCount].aabb;
+	for (int i = planeCount - 2; i >= 0; --i)
+	{
+		planes[i].rightCount = planes[i + 1].rightCount + bins[i + 1].count;
+		planes[i].rightAABB = dtUnion(planes[i + 1].rightAABB, bins[i + 1].aabb);
+	}
+
+	float minCost = FLT_MAX;
+	int bestPlane = 0;
+	for (int i = 0; i < planeCount; ++i)
+	{
+		float leftArea = dtArea(planes[i].leftAABB);
+		float rightArea = dtArea(planes[i].rightAABB);
+		int leftCount = planes[i].leftCount;
+		int rightCount = planes[i].rightCount;
+
+		float cost = leftCount * leftArea + rightCount * rightArea;
+		if (cost < minCost)
+		{
+			bestPlane = i;
+			minCost = cost;
+		}
+	}
+
+	return bestPlane;
+}
+
+// Move the leaves binned left of the plane to the front. The bin index is stored
+// in next. Returns the left count, which is kept in [1, count - 1].
+static int dtPartitionLeaves(dtNode* leaves, int count, int bestPlane)
+{
+	int i1 = -1;
+	for (int i2 = 0; i2 < count; ++i2)
+	{
+		int binIndex = leaves[i2].next;
+		if (binIndex <= bestPlane)
+		{
+			++i1;
+			dtSwap(leaves[i1], leaves[i2]);
+		}
+	}
+
+	int leftCount = i1 + 1;
+	int rightCount = count - leftCount;
+
+	if (leftCount == 0)
+	{
+		leftCount = 1;
+	}
+	else if (rightCount == 0)
+	{
+		leftCount -= 1;
+	}
+
+	return leftCount;
+}
+
 // TODO_ERIN this is slower than incremental with rotations. It should be faster.
 void dtTree::BuildTopDownSAH(int* proxies, dtAABB* boxes, int count)
 {
@@ -2100,28 +3227,120 @@ int dtTree::BinSortBoxes(int parentIndex, dtNode* leaves, int count, dtTreeBin*
 		centroidAABB.upperBound = dtMax(centroidAABB.upperBound, center);
 	}
 
-	dtVec d = centroidAABB.upperBound - centroidAABB.lowerBound;
-
-	int axisIndex;
 	float invD;
-	if (dtGetX(d) > dtGetY(d) && dtGetX(d) > dtGetZ(d))
+	int axisIndex = dtChooseSplitAxis(centroidAABB, invD);
+
+	for (int i = 0; i < dt_binCount; ++i)
 	{
-		axisIndex = 0;
-		invD = dtGetX(d);
+		bins[i].aabb.lowerBound = dtSplat(FLT_MAX);
+		bins[i].aabb.upperBound = dtSplat(-FLT_MAX);
+		bins[i].count = 0;
 	}
-	else if (dtGetY(d) > dtGetZ(d))
+
+	float binCount = float(dt_binCount);
+	float minC = dtGet(centroidAABB.lowerBound, axisIndex);
+	for (int i = 0; i < count; ++i)
 	{
-		axisIndex = 1;
-		invD = dtGetY(d);
+		dtVec c = dtCenter(leaves[i].aabb);
+		int binIndex = int(binCount * (dtGet(c, axisIndex) - minC) * invD);
+		binIndex = dtClamp(binIndex, 0, dt_binCount - 1);
+		leaves[i].next = binIndex;
+		bins[binIndex].count += 1;
+		bins[binIndex].aabb = dtUnion(bins[binIndex].aabb, leaves[i].aabb);
 	}
-	else
+
+	int bestPlane = dtFindBestPlane(bins, planes);
+
+	assert(m_nodeCount < m_nodeCapacity);
+	int nodeIndex = m_nodeCount++;
+	dtNode& node = m_nodes[nodeIndex];
+	node.aabb = dtUnion(planes[bestPlane].leftAABB, planes[bestPlane].rightAABB);
+	node.parent = parentIndex;
+	node.isLeaf = false;
+
+	int leftCount = dtPartitionLeaves(leaves, count, bestPlane);
+	int rightCount = count - leftCount;
+
+	node.child1 = BinSortBoxes(nodeIndex, leaves, leftCount, bins, planes);
+	node.child2 = BinSortBoxes(nodeIndex, leaves + leftCount, rightCount, bins, planes);
+
+	const dtNode& child1 = m_nodes[node.child1];
+	const dtNode& child2 = m_nodes[node.child2];
+
+	node.height = 1 + dtMax(child1.height, child2.height);
+
+	return nodeIndex;
+}
+
+// Nodes with at least this many leaves are binned on several threads.
+#define dt_parallelBinCount 16384
+
+// Subtrees with at least this many leaves are built as separate tasks.
+#define dt_parallelTaskCount 512
+
+// Leaves per binning task.
+#define dt_parallelBinRange 4096
+
+struct dtParallelBuild
+{
+	dtTaskScheduler* scheduler;
+	dtNode* nodes;
+	int leafCount;
+};
+
+// Centroid bounds of the leaves. Large ranges are reduced from per task bounds.
+static dtAABB dtComputeCentroidBounds(dtParallelBuild& build, dtNode* leaves, int count)
+{
+	dtAABB result;
+	result.lowerBound = dtSplat(FLT_MAX);
+	result.upperBound = dtSplat(-FLT_MAX);
+
+	if (count < dt_parallelBinCount || build.scheduler->GetThreadCount() == 1)
 	{
-		axisIndex = 2;
-		invD = dtGetZ(d);
+		for (int i = 0; i < count; ++i)
+		{
+			dtVec center = dtCenter(leaves[i].aabb);
+			result.lowerBound = dtMin(result.lowerBound, center);
+			result.upperBound = dtMax(result.upperBound, center);
+		}
+
+		return result;
 	}
 
-	invD = invD > 0.0f ? 1.0f / invD : 0.0f;
+	int taskCount = (count + dt_parallelBinRange - 1) / dt_parallelBinRange;
+	std::vector<dtAABB> partials(taskCount);
+
+	build.scheduler->ParallelFor(taskCount, 1, [leaves, count, &partials](int firstTask, int lastTask)
+	{
+		for (int task = firstTask; task < lastTask; ++task)
+		{
+			int begin = task * dt_parallelBinRange;
+			int end = dtMin(begin + dt_parallelBinRange, count);
+
+			dtAABB aabb;
+			aabb.lowerBound = dtSplat(FLT_MAX);
+			aabb.upperBound = dtSplat(-FLT_MAX);
+			for (int i = begin; i < end; ++i)
+			{
+				dtVec center = dtCenter(leaves[i].aabb);
+				aabb.lowerBound = dtMin(aabb.lowerBound, center);
+				aabb.upperBound = dtMax(aabb.upperBound, center);
+			}
+
+			partials[task] = aabb;
+		}
+	});
+
+	for (int task = 0; task < taskCount; ++task)
+	{
+		result = dtUnion(result, partials[task]);
+	}
+
+	return result;
+}
 
+static void dtBinLeaves(dtNode* leaves, int begin, int end, int axisIndex, float minC, float invD, dtTreeBin* bins)
+{
 	for (int i = 0; i < dt_binCount; ++i)
 	{
 		bins[i].aabb.lowerBound = dtSplat(FLT_MAX);
@@ -2130,8 +3349,7 @@ int dtTree::BinSortBoxes(int parentIndex, dtNode* leaves, int count, dtTreeBin*
 	}
 
 	float binCount = float(dt_binCount);
-	float minC = dtGet(centroidAABB.lowerBound, axisIndex);
-	for (int i = 0; i < count; ++i)
+	for (int i = begin; i < end; ++i)
 	{
 		dtVec c = dtCenter(leaves[i].aabb);
 		int binIndex = int(binCount * (dtGet(c, axisIndex) - minC) * invD);
@@ -2140,83 +3358,161 @@ int dtTree::BinSortBoxes(int parentIndex, dtNode* leaves, int count, dtTreeBin*
 		bins[binIndex].count += 1;
 		bins[binIndex].aabb = dtUnion(bins[binIndex].aabb, leaves[i].aabb);
 	}
+}
 
-	int planeCount = dt_binCount - 1;
+// The left subtree of a node, built by another thread.
+struct dtSubtreeTask
+{
+	dtParallelBuild* build;
+	dtNode* node;
+	int first;
+	int count;
+	int parentIndex;
+};
 
-	planes[0].leftCount = bins[0].count;
-	planes[0].leftAABB = bins[0].aabb;
-	for (int i = 1; i < planeCount; ++i)
+static void dtBuildSubtreeTask(void* context);
+
+// Same split as dtTree::BinSortBoxes. The internal node separating leaves i and i + 1
+// is stored at leafCount + i, so subtrees can be built on any thread without sharing
+// a node counter.
+static int dtBuildSubtreeSAH(dtParallelBuild& build, int first, int count, int parentIndex)
+{
+	dtNode* leaves = build.nodes + first;
+
+	if (count == 1)
 	{
-		planes[i].leftCount = planes[i - 1].leftCount + bins[i].count;
-		planes[i].leftAABB = dtUnion(planes[i - 1].leftAABB, bins[i].aabb);
+		leaves[0].parent = parentIndex;
+		return first;
 	}
 
-	planes[planeCount - 1].rightCount = bins[planeCount].count;
-	planes[planeCount - 1].rightAABB = bins[planeCount].aabb;
-	for (int i = planeCount - 2; i >= 0; --i)
+	dtAABB centroidAABB = dtComputeCentroidBounds(build, leaves, count);
+
+	float invD;
+	int axisIndex = dtChooseSplitAxis(centroidAABB, invD);
+	float minC = dtGet(centroidAABB.lowerBound, axisIndex);
+
+	dtTreeBin bins[dt_binCount];
+	if (count < dt_parallelBinCount || build.scheduler->GetThreadCount() == 1)
 	{
-		planes[i].rightCount = planes[i + 1].rightCount + bins[i + 1].count;
-		planes[i].rightAABB = dtUnion(planes[i + 1].rightAABB, bins[i + 1].aabb);
+		dtBinLeaves(leaves, 0, count, axisIndex, minC, invD, bins);
 	}
-
-	float minCost = FLT_MAX;
-	int bestPlane = 0;
-	for (int i = 0; i < planeCount; ++i)
+	else
 	{
-		float leftArea = dtArea(planes[i].leftAABB);
-		float rightArea = dtArea(planes[i].rightAABB);
-		int leftCount = planes[i].leftCount;
-		int rightCount = planes[i].rightCount;
+		// Per task bins, reduced afterwards.
+		int taskCount = (count + dt_parallelBinRange - 1) / dt_parallelBinRange;
+		std::vector<dtTreeBin> partials(taskCount * dt_binCount);
 
-		float cost = leftCount * leftArea + rightCount * rightArea;
-		if (cost < minCost)
+		build.scheduler->ParallelFor(taskCount, 1, [=, &partials](int firstTask, int lastTask)
 		{
-			bestPlane = i;
-			minCost = cost;
-		}
-	}
-
-	assert(m_nodeCount < m_nodeCapacity);
-	int nodeIndex = m_nodeCount++;
-	dtNode& node = m_nodes[nodeIndex];
-	node.aabb = dtUnion(planes[bestPlane].leftAABB, planes[bestPlane].rightAABB);
-	node.parent = parentIndex;
-	node.isLeaf = false;
+			for (int task = firstTask; task < lastTask; ++task)
+			{
+				int begin = task * dt_parallelBinRange;
+				int end = dtMin(begin + dt_parallelBinRange, count);
+				dtBinLeaves(leaves, begin, end, axisIndex, minC, invD, partials.data() + task * dt_binCount);
+			}
+		});
 
-	int i1 = -1;
-	for (int i2 = 0; i2 < count; ++i2)
-	{
-		int binIndex = leaves[i2].next;
-		if (binIndex <= bestPlane)
+		for (int i = 0; i < dt_binCount; ++i)
 		{
-			++i1;
-			dtSwap(leaves[i1], leaves[i2]);
+			bins[i] = partials[i];
+			for (int task = 1; task < taskCount; ++task)
+			{
+				const dtTreeBin& bin = partials[task * dt_binCount + i];
+				bins[i].count += bin.count;
+				bins[i].aabb = dtUnion(bins[i].aabb, bin.aabb);
+			}
 		}
 	}
 
-	int leftCount = i1 + 1;
+	dtTreePlane planes[dt_binCount - 1];
+	int bestPlane = dtFindBestPlane(bins, planes);
+	int leftCount = dtPartitionLeaves(leaves, count, bestPlane);
 	int rightCount = count - leftCount;
 
-	if (leftCount == 0)
+	int nodeIndex = build.leafCount + first + leftCount - 1;
+	dtNode* node = build.nodes + nodeIndex;
+	node->aabb = dtUnion(planes[bestPlane].leftAABB, planes[bestPlane].rightAABB);
+	node->parent = parentIndex;
+	node->isLeaf = false;
+
+	if (count >= dt_parallelTaskCount && build.scheduler->GetThreadCount() > 1)
 	{
-		leftCount = 1;
-		rightCount -= 1;
+		// Leave the left subtree for another thread to steal.
+		dtSubtreeTask task;
+		task.build = &build;
+		task.node = node;
+		task.first = first;
+		task.count = leftCount;
+		task.parentIndex = nodeIndex;
+
+		dtTaskGroup group;
+		build.scheduler->Run(group, dtBuildSubtreeTask, &task);
+
+		node->child2 = dtBuildSubtreeSAH(build, first + leftCount, rightCount, nodeIndex);
+		build.scheduler->Wait(group);
 	}
-	else if (rightCount == 0)
+	else
 	{
-		leftCount -= 1;
-		rightCount = 1;
+		node->child1 = dtBuildSubtreeSAH(build, first, leftCount, nodeIndex);
+		node->child2 = dtBuildSubtreeSAH(build, first + leftCount, rightCount, nodeIndex);
 	}
 
-	node.child1 = BinSortBoxes(nodeIndex, leaves, leftCount, bins, planes);
-	node.child2 = BinSortBoxes(nodeIndex, leaves + leftCount, rightCount, bins, planes);
+	const dtNode& child1 = build.nodes[node->child1];
+	const dtNode& child2 = build.nodes[node->child2];
+	node->height = 1 + dtMax(child1.height, child2.height);
 
-	const dtNode& child1 = m_nodes[node.child1];
-	const dtNode& child2 = m_nodes[node.child2];
+	return nodeIndex;
+}
 
-	node.height = 1 + dtMax(child1.height, child2.height);
+static void dtBuildSubtreeTask(void* context)
+{
+	dtSubtreeTask* task = static_cast<dtSubtreeTask*>(context);
+	task->node->child1 = dtBuildSubtreeSAH(*task->build, task->first, task->count, task->parentIndex);
+}
 
-	return nodeIndex;
+void dtTree::BuildTopDownSAHParallel(int* proxies, dtAABB* boxes, int count, dtTaskScheduler& scheduler)
+{
+	free(m_nodes);
+
+	m_freeList = dt_nullNode;
+	m_nodeCapacity = 2 * count - 1;
+	m_nodes = (dtNode*)malloc(m_nodeCapacity * sizeof(dtNode));
+
+	scheduler.ParallelFor(count, dt_parallelBinRange, [this, boxes](int begin, int end)
+	{
+		memset(m_nodes + begin, 0, (end - begin) * sizeof(dtNode));
+		for (int i = begin; i < end; ++i)
+		{
+			m_nodes[i].aabb = boxes[i];
+			// Use objectIndex to store the proxy index
+			m_nodes[i].child1 = dt_nullNode;
+			m_nodes[i].child2 = dt_nullNode;
+			m_nodes[i].height = 0;
+			m_nodes[i].isLeaf = true;
+			m_nodes[i].objectIndex = i;
+			m_nodes[i].next = -1;
+			m_nodes[i].parent = dt_nullNode;
+		}
+	});
+
+	dtParallelBuild build;
+	build.scheduler = &scheduler;
+	build.nodes = m_nodes;
+	build.leafCount = count;
+	m_root = dtBuildSubtreeSAH(build, 0, count, dt_nullNode);
+
+	m_nodeCount = m_nodeCapacity;
+	m_proxyCount = count;
+
+	for (int i = 0; i < count; ++i)
+	{
+		const dtNode& n = m_nodes[i];
+		assert(n.isLeaf);
+		assert(0 <= n.objectIndex && n.objectIndex < count);
+		proxies[n.objectIndex] = i;
+	}
+
+	Validate();
 }
 
 void dtTree::BuildTopDownMedianSplit(int* proxies, dtAABB* boxes, int count)
@@ -2361,3 +3657,241 @@ int dtTree::PartitionBoxes(int parentIndex, dtNode* leaves, int count)
 
 	return nodeIndex;
 }
+
+// Spread the lower 10 bits so there are two zero bits between each.
+static inline uint32_t dtExpandBits(uint32_t v)
+{
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+static inline int dtCountLeadingZeros(uint32_t v)
+{
+	assert(v != 0);
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanReverse(&index, v);
+	return 31 - int(index);
+#else
+	return __builtin_clz(v);
+#endif
+}
+
+#define dt_radixBits 10
+#define dt_radixSize (1 << dt_radixBits)
+#define dt_radixPasses 3
+
+// Sort the boxes along a 30-bit Morton curve of their centers. Writes the sorted
+// codes and the box index of each code. This is an LSD radix sort with 10-bit
+// digits. All digit histograms are counted in one pass and digits that are the
+// same for every code are skipped. A 63-bit curve gave the same tree quality on
+// the sample data at twice the sorting cost. Boxes that share a cell are still
+// split evenly, see dtSplitLevel.
+static void dtSortMorton(const dtAABB* boxes, int count, std::vector<uint32_t>& codes, std::vector<int>& order,
+	std::vector<uint32_t>& tempCodes, std::vector<int>& tempOrder)
+{
+	dtAABB centroidAABB;
+	centroidAABB.lowerBound = dtSplat(FLT_MAX);
+	centroidAABB.upperBound = dtSplat(-FLT_MAX);
+	for (int i = 0; i < count; ++i)
+	{
+		dtVec center = dtCenter(boxes[i]);
+		centroidAABB.lowerBound = dtMin(centroidAABB.lowerBound, center);
+		centroidAABB.upperBound = dtMax(centroidAABB.upperBound, center);
+	}
+
+	// Quantize to 10 bits per axis.
+	const float gridSize = float((1 << 10) - 1);
+	dtVec extent = centroidAABB.upperBound - centroidAABB.lowerBound;
+	dtVec scale = _mm_div_ps(dtSplat(gridSize), _mm_max_ps(extent, dtSplat(FLT_MIN)));
+	dtVec lower = centroidAABB.lowerBound;
+
+	codes.resize(count);
+	order.resize(count);
+	tempCodes.resize(count);
+	tempOrder.resize(count);
+	int histograms[dt_radixPasses][dt_radixSize] = {};
+
+	for (int i = 0; i < count; ++i)
+	{
+		dtVec q = dtMin(dtMax((dtCenter(boxes[i]) - lower) * scale, dtVec_Zero), dtSplat(gridSize));
+
+		alignas(16) int cell[4];
+		_mm_store_si128((__m128i*)cell, _mm_cvttps_epi32(q));
+
+		uint32_t code = (dtExpandBits(cell[0]) << 2) | (dtExpandBits(cell[1]) << 1) | dtExpandBits(cell[2]);
+		codes[i] = code;
+		order[i] = i;
+
+		for (int pass = 0; pass < dt_radixPasses; ++pass)
+		{
+			++histograms[pass][(code >> (pass * dt_radixBits)) & (dt_radixSize - 1)];
+		}
+	}
+
+	for (int pass = 0; pass < dt_radixPasses; ++pass)
+	{
+		int shift = pass * dt_radixBits;
+		int* histogram = histograms[pass];
+
+		if (histogram[(codes[0] >> shift) & (dt_radixSize - 1)] == count)
+		{
+			continue;
+		}
+
+		int offset = 0;
+		for (int i = 0; i < dt_radixSize; ++i)
+		{
+			int n = histogram[i];
+			histogram[i] = offset;
+			offset += n;
+		}
+
+		for (int i = 0; i < count; ++i)
+		{
+			int index = histogram[(codes[i] >> shift) & (dt_radixSize - 1)]++;
+			tempCodes[index] = codes[i];
+			tempOrder[index] = order[i];
+		}
+
+		codes.swap(tempCodes);
+		order.swap(tempOrder);
+	}
+}
+
+// Split priority between the sorted leaves i and i + 1. This is one more than the
+// highest differing bit of the codes, offset so that equal codes are split by index
+// below all other splits. Lower values are merged first.
+static inline int dtSplitLevel(const uint32_t* codes, int i)
+{
+	uint32_t x = codes[i] ^ codes[i + 1];
+	if (x != 0)
+	{
+		return 64 - dtCountLeadingZeros(x);
+	}
+
+	return 32 - dtCountLeadingZeros(uint32_t(i ^ (i + 1)));
+}
+
+// "Fast and Simple Agglomerative LBVH Construction" by Ciprian Apetrei
+// Each leaf climbs the tree. A subtree covering leaves [left, right] becomes a child
+// of the split at right if that split is lower than the split at left - 1, otherwise
+// of the split at left - 1. The second child to reach a node finishes it and climbs on,
+// so the hierarchy, bounds and heights come out of one linear pass.
+void dtTree::BuildLBVH(int* proxies, dtAABB* boxes, int count)
+{
+	// Fresh pages are expensive to touch, so the pool is only replaced when it is too small.
+	// An empty set leaves the whole pool on the free list.
+	int nodeCount = count > 0 ? 2 * count - 1 : 0;
+	if (m_nodeCapacity < nodeCount)
+	{
+		free(m_nodes);
+		m_nodeCapacity = nodeCount;
+		m_nodes = (dtNode*)malloc(m_nodeCapacity * sizeof(dtNode));
+	}
+
+	m_freeList = dt_nullNode;
+	for (int i = m_nodeCapacity - 1; i >= nodeCount; --i)
+	{
+		m_nodes[i].next = m_freeList;
+		m_nodes[i].height = dt_nullNode;
+		m_freeList = i;
+	}
+
+	m_nodeCount = nodeCount;
+	m_proxyCount = count;
+
+	if (count == 0)
+	{
+		m_root = dt_nullNode;
+		return;
+	}
+
+	std::vector<uint32_t>& codes = m_mortonCodes;
+	std::vector<int>& order = m_buildOrder;
+	dtSortMorton(boxes, count, codes, order, m_mortonScratch, m_buildScratch);
+
+	// Leaves in Morton order
+	for (int i = 0; i < count; ++i)
+	{
+		int boxIndex = order[i];
+		dtNode& leaf = m_nodes[i];
+		leaf.aabb = boxes[boxIndex];
+		leaf.parent = dt_nullNode;
+		leaf.child1 = dt_nullNode;
+		leaf.child2 = dt_nullNode;
+		leaf.height = 0;
+		leaf.objectIndex = boxIndex;
+		leaf.isLeaf = true;
+		proxies[boxIndex] = i;
+	}
+
+	m_root = 0;
+	if (count == 1)
+	{
+		return;
+	}
+
+	// The internal node at split i is stored at count + i. The first child to arrive
+	// leaves the far end of its range here.
+	const uint32_t* sortedCodes = codes.data();
+	std::vector<int>& otherBounds = m_buildScratch;
+	otherBounds.assign(count - 1, dt_nullNode);
+
+	for (int i = 0; i < count; ++i)
+	{
+		int index = i;
+		int left = i;
+		int right = i;
+
+		for (;;)
+		{
+			if (left == 0 && right == count - 1)
+			{
+				m_root = index;
+				m_nodes[index].parent = dt_nullNode;
+				break;
+			}
+
+			int split;
+			if (left == 0 || (right != count - 1 && dtSplitLevel(sortedCodes, right) < dtSplitLevel(sortedCodes, left - 1)))
+			{
+				split = right;
+				m_nodes[count + split].child1 = index;
+			}
+			else
+			{
+				split = left - 1;
+				m_nodes[count + split].child2 = index;
+			}
+
+			int parentIndex = count + split;
+			m_nodes[index].parent = parentIndex;
+
+			int otherBound = otherBounds[split];
+			if (otherBound == dt_nullNode)
+			{
+				otherBounds[split] = split == right ? left : right;
+				break;
+			}
+
+			left = dtMin(left, otherBound);
+			right = dtMax(right, otherBound);
+
+			dtNode& node = m_nodes[parentIndex];
+			const dtNode& child1 = m_nodes[node.child1];
+			const dtNode& child2 = m_nodes[node.child2];
+			node.aabb = dtUnion(child1.aabb, child2.aabb);
+			node.height = 1 + dtMax(child1.height, child2.height);
+			node.objectIndex = -1;
+			node.isLeaf = false;
+
+			index = parentIndex;
+		}
+	}
+
+	Validate();
+}
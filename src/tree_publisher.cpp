@@ -0,0 +1,108 @@
+/*
+* Copyright (c) 2019 Erin Catto http://www.box2d.org
+*
+* Permission to use, copy, modify, distribute and sell this software
+* and its documentation for any purpose is hereby granted without fee,
+* provided that the above copyright notice appear in all copies.
+* Erin Catto makes no representations about the suitability
+* of this software for any purpose.
+* It is provided "as is" without express or implied warranty.
+*/
+
+#include "dynamic-tree/tree_publisher.h"
+
+dtTreePublisher::dtTreePublisher()
+{
+	for (int i = 0; i < dt_maxSnapshotBuffers; ++i)
+	{
+		m_buffers[i].tree = nullptr;
+		m_buffers[i].readerCount.store(0, std::memory_order_relaxed);
+	}
+
+	m_bufferCount = 0;
+	m_current.store(-1, std::memory_order_relaxed);
+}
+
+dtTreePublisher::~dtTreePublisher()
+{
+	for (int i = 0; i < m_bufferCount; ++i)
+	{
+		delete m_buffers[i].tree;
+	}
+}
+
+bool dtTreePublisher::Publish(const dtTree& tree)
+{
+	// The seq_cst load of the reader count pairs with the seq_cst increment and
+	// current check in Acquire. A reader that arrives after this load sees that the
+	// buffer is no longer current and backs off before touching the nodes.
+	int current = m_current.load(std::memory_order_relaxed);
+	int index = -1;
+	for (int i = 0; i < m_bufferCount; ++i)
+	{
+		if (i != current && m_buffers[i].readerCount.load(std::memory_order_seq_cst) == 0)
+		{
+			index = i;
+			break;
+		}
+	}
+
+	if (index == -1)
+	{
+		if (m_bufferCount == dt_maxSnapshotBuffers)
+		{
+			return false;
+		}
+
+		index = m_bufferCount;
+		m_buffers[index].tree = new dtTree;
+		++m_bufferCount;
+	}
+
+	m_buffers[index].tree->CopyFrom(tree);
+
+	m_current.store(index, std::memory_order_seq_cst);
+	return true;
+}
+
+const dtTree* dtTreePublisher::Acquire() const
+{
+	for (;;)
+	{
+		int index = m_current.load(std::memory_order_seq_cst);
+		if (index == -1)
+		{
+			return nullptr;
+		}
+
+		// Pin the buffer, then make sure the writer did not retire it in the meantime.
+		std::atomic<int>& readerCount = m_buffers[index].readerCount;
+		readerCount.fetch_add(1, std::memory_order_seq_cst);
+		if (m_current.load(std::memory_order_seq_cst) == index)
+		{
+			return m_buffers[index].tree;
+		}
+
+		readerCount.fetch_sub(1, std::memory_order_release);
+	}
+}
+
+void dtTreePublisher::Release(const dtTree* snapshot) const
+{
+	for (int i = 0; i < dt_maxSnapshotBuffers; ++i)
+	{
+		if (m_buffers[i].tree == snapshot)
+		{
+			// Order the reads of this reader before the writer reuses the buffer.
+			m_buffers[i].readerCount.fetch_sub(1, std::memory_order_release);
+			return;
+		}
+	}
+
+	assert(false);
+}
+
+int dtTreePublisher::GetBufferCount() const
+{
+	return m_bufferCount;
+}
@@ -11,6 +11,69 @@
 
 #include "dynamic-tree/utils.h"
 
+#if !defined(_MSC_VER)
+#include <cpuid.h>
+#endif
+
+static bool dtQueryAVX2()
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+	{
+		return false;
+	}
+
+	__cpuid(info, 1);
+	unsigned int ecx1 = info[2];
+
+	__cpuidex(info, 7, 0);
+	unsigned int ebx7 = info[1];
+#else
+	unsigned int eax, ebx, ecx, edx;
+	if (__get_cpuid(0, &eax, &ebx, &ecx, &edx) == 0 || eax < 7)
+	{
+		return false;
+	}
+
+	__get_cpuid(1, &eax, &ebx, &ecx, &edx);
+	unsigned int ecx1 = ecx;
+
+	__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx);
+	unsigned int ebx7 = ebx;
+#endif
+
+	// AVX and OSXSAVE, otherwise xgetbv is not available.
+	const unsigned int avxBits = (1u << 27) | (1u << 28);
+	if ((ecx1 & avxBits) != avxBits)
+	{
+		return false;
+	}
+
+	// The operating system must save the ymm registers.
+#if defined(_MSC_VER)
+	unsigned long long xcr0 = _xgetbv(0);
+#else
+	unsigned int xcr0Low, xcr0High;
+	__asm__("xgetbv" : "=a"(xcr0Low), "=d"(xcr0High) : "c"(0));
+	unsigned long long xcr0 = xcr0Low;
+#endif
+
+	if ((xcr0 & 6) != 6)
+	{
+		return false;
+	}
+
+	return (ebx7 & (1u << 5)) != 0;
+}
+
+bool dtHasAVX2()
+{
+	static const bool s_hasAVX2 = dtQueryAVX2();
+	return s_hasAVX2;
+}
+
 #if defined(_WIN32)
 
 double dtTimer::s_invFrequency = 0.0f;
@@ -55,19 +118,51 @@ float dtTimer::GetMilliseconds() const
 	return ms;
 }
 
+unsigned long long dtGetNanoseconds()
+{
+	static unsigned long long s_frequency = 0;
+
+	LARGE_INTEGER largeInteger;
+	if (s_frequency == 0)
+	{
+		QueryPerformanceFrequency(&largeInteger);
+		s_frequency = largeInteger.QuadPart;
+	}
+
+	QueryPerformanceCounter(&largeInteger);
+	unsigned long long count = largeInteger.QuadPart;
+
+	// Split to avoid overflow of count * 1e9
+	unsigned long long seconds = count / s_frequency;
+	unsigned long long remainder = count % s_frequency;
+	return seconds * 1000000000ull + remainder * 1000000000ull / s_frequency;
+}
+
 #else
 
+#include <time.h>
+
+unsigned long long dtGetNanoseconds()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (unsigned long long)t.tv_sec * 1000000000ull + (unsigned long long)t.tv_nsec;
+}
+
 dtTimer::dtTimer()
 {
+	m_start = dtGetNanoseconds();
 }
 
 void dtTimer::Reset()
 {
+	m_start = dtGetNanoseconds();
 }
 
-float32 dtTimer::GetMilliseconds() const
+float dtTimer::GetMilliseconds() const
 {
-	return 0.0f;
+	unsigned long long count = dtGetNanoseconds() - m_start;
+	return float(1.0e-6 * double(count));
 }
 
 #endif
@@ -0,0 +1,274 @@
+/*
+* Copyright (c) 2019 Erin Catto http://www.box2d.org
+*
+* Permission to use, copy, modify, distribute and sell this software
+* and its documentation for any purpose is hereby granted without fee,
+* provided that the above copyright notice appear in all copies.
+* Erin Catto makes no representations about the suitability
+* of this software for any purpose.
+* It is provided "as is" without express or implied warranty.
+*/
+
+#include "dynamic-tree/wide_tree.h"
+#include <assert.h>
+#include <stdint.h>
+
+static_assert(sizeof(dtWideNode8) == 256, "8-wide node should be four cache lines");
+
+dtWideTree::dtWideTree()
+{
+	m_useAVX2 = dtHasAVX2();
+	m_width = dt_wideCount;
+	m_nodes = nullptr;
+	m_nodes8 = nullptr;
+	m_sources = nullptr;
+	m_nodeCount = 0;
+	m_nodeCapacity = 0;
+	m_nodeCapacity8 = 0;
+	m_sourceCapacity = 0;
+}
+
+dtWideTree::~dtWideTree()
+{
+	free(m_nodes);
+	_mm_free(m_nodes8);
+	free(m_sources);
+}
+
+void dtWideTree::Clear()
+{
+	m_nodeCount = 0;
+}
+
+int dtWideTree::GetNodeCount() const
+{
+	return m_nodeCount;
+}
+
+int dtCollapseNode(const dtTree& tree, int nodeIndex, int* children, int width)
+{
+	const dtNode& node = tree.m_nodes[nodeIndex];
+	if (node.isLeaf)
+	{
+		children[0] = nodeIndex;
+		return 1;
+	}
+
+	children[0] = node.child1;
+	children[1] = node.child2;
+	int count = 2;
+
+	while (count < width)
+	{
+		// Open the internal child with the largest area.
+		int bestIndex = -1;
+		float bestArea = -FLT_MAX;
+		for (int i = 0; i < count; ++i)
+		{
+			const dtNode& child = tree.m_nodes[children[i]];
+			if (child.isLeaf)
+			{
+				continue;
+			}
+
+			float area = dtArea(child.aabb);
+			if (area > bestArea)
+			{
+				bestIndex = i;
+				bestArea = area;
+			}
+		}
+
+		if (bestIndex == -1)
+		{
+			break;
+		}
+
+		const dtNode& child = tree.m_nodes[children[bestIndex]];
+		children[bestIndex] = child.child1;
+		children[count] = child.child2;
+		++count;
+	}
+
+	return count;
+}
+
+// Transpose the bounds of the four lanes into the node. Empty lanes get inverted bounds.
+static void dtSetWideBounds(dtWideNode& node, const dtTree& tree, const int* sources)
+{
+	dtVec lower[dt_wideCount];
+	dtVec upper[dt_wideCount];
+
+	for (int i = 0; i < dt_wideCount; ++i)
+	{
+		if (sources[i] == dt_nullNode)
+		{
+			lower[i] = dtSplat(FLT_MAX);
+			upper[i] = dtSplat(-FLT_MAX);
+		}
+		else
+		{
+			lower[i] = tree.m_nodes[sources[i]].aabb.lowerBound;
+			upper[i] = tree.m_nodes[sources[i]].aabb.upperBound;
+		}
+	}
+
+	_MM_TRANSPOSE4_PS(lower[0], lower[1], lower[2], lower[3]);
+	_MM_TRANSPOSE4_PS(upper[0], upper[1], upper[2], upper[3]);
+
+	node.lowerX = lower[0];
+	node.lowerY = lower[1];
+	node.lowerZ = lower[2];
+	node.upperX = upper[0];
+	node.upperY = upper[1];
+	node.upperZ = upper[2];
+}
+
+// The 8-wide node is filled with scalar stores so this file needs no AVX support.
+static void dtSetWideBounds(dtWideNode8& node, const dtTree& tree, const int* sources)
+{
+	for (int i = 0; i < dt_wideCount8; ++i)
+	{
+		if (sources[i] == dt_nullNode)
+		{
+			node.lowerX[i] = FLT_MAX;
+			node.lowerY[i] = FLT_MAX;
+			node.lowerZ[i] = FLT_MAX;
+			node.upperX[i] = -FLT_MAX;
+			node.upperY[i] = -FLT_MAX;
+			node.upperZ[i] = -FLT_MAX;
+		}
+		else
+		{
+			const dtAABB& aabb = tree.m_nodes[sources[i]].aabb;
+			node.lowerX[i] = dtGetX(aabb.lowerBound);
+			node.lowerY[i] = dtGetY(aabb.lowerBound);
+			node.lowerZ[i] = dtGetZ(aabb.lowerBound);
+			node.upperX[i] = dtGetX(aabb.upperBound);
+			node.upperY[i] = dtGetY(aabb.upperBound);
+			node.upperZ[i] = dtGetZ(aabb.upperBound);
+		}
+	}
+}
+
+// Wide nodes are allocated when their parent is written, so the child links are
+// known right away. Each wide node replaces at least one internal binary node, so
+// the binary node count bounds the wide node count. The caller sizes the arrays
+// for that bound and checks the returned count against its capacity.
+template <typename N, int W>
+static int dtBuildWideNodes(N* nodes, int* allSources, const dtTree& tree)
+{
+	struct StackEntry
+	{
+		int treeIndex;
+		int wideIndex;
+	};
+
+	int nodeCount = 0;
+
+	dtGrowableStack<StackEntry, 256> stack;
+	stack.Push({ tree.m_root, nodeCount++ });
+
+	while (stack.GetCount() > 0)
+	{
+		StackEntry entry = stack.Pop();
+
+		int* sources = allSources + W * entry.wideIndex;
+		int count = dtCollapseNode(tree, entry.treeIndex, sources, W);
+
+		N& node = nodes[entry.wideIndex];
+		node.leafMask = 0;
+
+		for (int i = 0; i < W; ++i)
+		{
+			if (i >= count)
+			{
+				sources[i] = dt_nullNode;
+				node.children[i] = dt_nullNode;
+				continue;
+			}
+
+			int child = sources[i];
+			if (tree.m_nodes[child].isLeaf)
+			{
+				node.children[i] = child;
+				node.leafMask |= 1 << i;
+			}
+			else
+			{
+				node.children[i] = nodeCount++;
+				stack.Push({ child, node.children[i] });
+			}
+		}
+
+		dtSetWideBounds(node, tree, sources);
+	}
+
+	return nodeCount;
+}
+
+void dtWideTree::Build(const dtTree& tree)
+{
+	m_nodeCount = 0;
+	m_width = m_useAVX2 ? dt_wideCount8 : dt_wideCount;
+
+	if (tree.m_root == dt_nullNode)
+	{
+		return;
+	}
+
+	if (m_sourceCapacity < m_width * tree.m_nodeCount)
+	{
+		free(m_sources);
+		m_sourceCapacity = m_width * tree.m_nodeCount;
+		m_sources = (int*)malloc(m_sourceCapacity * sizeof(int));
+	}
+
+	if (m_width == dt_wideCount8)
+	{
+		if (m_nodeCapacity8 < tree.m_nodeCount)
+		{
+			_mm_free(m_nodes8);
+			m_nodeCapacity8 = tree.m_nodeCount;
+			m_nodes8 = (dtWideNode8*)_mm_malloc(m_nodeCapacity8 * sizeof(dtWideNode8), 32);
+		}
+
+		m_nodeCount = dtBuildWideNodes<dtWideNode8, dt_wideCount8>(m_nodes8, m_sources, tree);
+		assert(m_nodeCount <= m_nodeCapacity8);
+	}
+	else
+	{
+		if (m_nodeCapacity < tree.m_nodeCount)
+		{
+			free(m_nodes);
+			m_nodeCapacity = tree.m_nodeCount;
+			m_nodes = (dtWideNode*)malloc(m_nodeCapacity * sizeof(dtWideNode));
+
+			// The bounds are loaded with aligned loads.
+			assert((uintptr_t(m_nodes) & 15) == 0);
+		}
+
+		m_nodeCount = dtBuildWideNodes<dtWideNode, dt_wideCount>(m_nodes, m_sources, tree);
+		assert(m_nodeCount <= m_nodeCapacity);
+	}
+
+	assert(m_nodeCount <= tree.m_nodeCount);
+}
+
+void dtWideTree::Refit(const dtTree& tree)
+{
+	if (m_width == dt_wideCount8)
+	{
+		for (int i = 0; i < m_nodeCount; ++i)
+		{
+			dtSetWideBounds(m_nodes8[i], tree, m_sources + dt_wideCount8 * i);
+		}
+	}
+	else
+	{
+		for (int i = 0; i < m_nodeCount; ++i)
+		{
+			dtSetWideBounds(m_nodes[i], tree, m_sources + dt_wideCount * i);
+		}
+	}
+}